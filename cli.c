@@ -1,4 +1,4 @@
-/* bd972bcd5c6b125df758e90d0fea4cdc8d463b1d420958f589c75d77c59b9d5d */
+/* 2e9dc2ddcf90f389af72ee26176c827293a96b8d1230c7ab805b252b99120673 */
 /*
   File autogenerated by gengetopt version 2.22.6
   generated with the following command:
@@ -34,20 +34,30 @@ const char *gengetopt_args_info_versiontext = "Created by Kovid Goyal";
 const char *gengetopt_args_info_description = "Filter a newline separated list of strings from STDIN to STDOUT based on the\nquery. Does subsequence matching of the query and returns the results sorted by\nrelevance.\n\nSubsequence matching has configurable \"special characters\". If a matched\ncharacter occurs immediately after one of these, it's score is higher. For\nmore details on the algorithm, see https://github.com/kovidgoyal/subseq-matcher\n\nSTDIN must be UTF-8 encoded and STDOUT will also be UTF-8 encoded.  The query\nstring must also be UTF-8 encoded. If you want to process string in another\nencoding, pipe them through iconv or similar.\n\n";
 
 const char *gengetopt_args_info_help[] = {
-  "  -h, --help                Print help and exit",
-  "  -V, --version             Print version and exit",
+  "  -h, --help                     Print help and exit",
+  "  -V, --version                  Print version and exit",
   "\nControl operation:",
-  "  -d, --delimiter=STRING    The character at which to split the input into\n                              lines. Defaults to the new line character.",
-  "  -t, --threads=INT         Number of worker threads to use. Default is to use\n                              the number of available CPUs  (default=`0')",
+  "  -i, --input=STRING             Read the lines from the specified file instead\n                              of STDIN. The file is memory mapped and ASCII\n                              lines are used in place, without copying. Files\n                              compressed with gzip, bzip2 or zstd are\n                              recognized and decompressed in a separate thread,\n                              while the lines are scored.",
+  "  -d, --delimiter=STRING         The character at which to split the input into\n                              lines. Defaults to the new line character.",
+  "  -t, --threads=INT              Maximum number of worker threads to use.\n                              Default is to use the number of available CPUs\n                              (default=`0')",
+  "      --work-per-thread=DOUBLE   The amount of scoring work, in milliseconds,\n                              that justifies each additional worker thread. The\n                              work is estimated by scoring a sample of the\n                              input. The default is about ten times the cost of\n                              starting a thread and handing it a task. Zero\n                              uses all threads.  (default=`1')",
+  "      --stats                    Print statistics about the work done by each\n                              worker thread to STDERR  (default=off)",
+  "      --pin-threads              Pin each worker thread to its own CPU. On NUMA\n                              systems this keeps the memory each worker\n                              allocates for scoring local to it.  (default=off)",
   "\nControl scoring:",
-  "  -1, --level1=STRING       The level 1 special characters.  (default=`/')",
-  "  -2, --level2=STRING       The level 2 special characters.  (default=`-_\n                              0123456789')",
-  "  -3, --level3=STRING       The level 3 special characters.  (default=`.')",
+  "  -1, --level1=STRING            The level 1 special characters.  (default=`/')",
+  "  -2, --level2=STRING            The level 2 special characters.  (default=`-_\n                              0123456789')",
+  "  -3, --level3=STRING            The level 3 special characters.  (default=`.')",
+  "      --exhaustive               Find the best match by enumerating every\n                              possible alignment of the query, instead of using\n                              dynamic programming. Much slower, useful only for\n                              testing.  (default=off)",
   "\nControl output:",
-  "  -l, --limit=INT           Limit the number of returned results.\n                              (default=`0')",
-  "  -b, --mark-before=STRING  String to output before each matched character",
-  "  -a, --mark-after=STRING   String to output after each matched character",
-  "  -p, --positions           Output match positions in the form\n                              <number>,<number>,...: before each result\n                              (default=off)",
+  "  -l, --limit=INT                Limit the number of returned results.\n                              (default=`0')",
+  "      --min-score=DOUBLE         Only return results with at least this score.\n                              Candidates that cannot reach it are abandoned as\n                              early as possible. A result that consists of just\n                              the query scores a little under one.\n                              (default=`0')",
+  "  -b, --mark-before=STRING       String to output before each matched character",
+  "  -a, --mark-after=STRING        String to output after each matched character",
+  "  -p, --positions                Output match positions in the form\n                              <number>,<number>,...: before each result\n                              (default=off)",
+  "      --format=STRING            The format of the output, either plain, the\n                              lines, with --mark-before, --mark-after and\n                              --positions applied, or jsonl, a JSON object per\n                              line, with the keys: line, index, the number of\n                              the line in the input, counting from zero, score\n                              and positions, the positions of the matched\n                              characters.  (default=`plain')",
+  "      --stream                   Output the best --limit results found so far\n                              periodically, while the input is still being\n                              read, each time followed by the --stream-marker.\n                              The scores of the lines already read are kept, so\n                              each refresh only scores the new lines. Without\n                              --limit, the best 100 results are output.\n                              (default=off)",
+  "      --refresh-interval=DOUBLE  The time, in milliseconds, between refreshes\n                              of the results with --stream.  (default=`100')",
+  "      --stream-marker=STRING     The line output after the results of every\n                              refresh with --stream, the last of which are the\n                              final results. Defaults to an empty line, which\n                              is never a result.",
     0
 };
 
@@ -55,6 +65,7 @@ typedef enum {ARG_NO
   , ARG_FLAG
   , ARG_STRING
   , ARG_INT
+  , ARG_DOUBLE
 } cmdline_parser_arg_type;
 
 static
@@ -75,38 +86,64 @@ void clear_given (struct gengetopt_args_info *args_info)
 {
   args_info->help_given = 0 ;
   args_info->version_given = 0 ;
+  args_info->input_given = 0 ;
   args_info->delimiter_given = 0 ;
   args_info->threads_given = 0 ;
+  args_info->work_per_thread_given = 0 ;
+  args_info->stats_given = 0 ;
+  args_info->pin_threads_given = 0 ;
   args_info->level1_given = 0 ;
   args_info->level2_given = 0 ;
   args_info->level3_given = 0 ;
+  args_info->exhaustive_given = 0 ;
   args_info->limit_given = 0 ;
+  args_info->min_score_given = 0 ;
   args_info->mark_before_given = 0 ;
   args_info->mark_after_given = 0 ;
   args_info->positions_given = 0 ;
+  args_info->format_given = 0 ;
+  args_info->stream_given = 0 ;
+  args_info->refresh_interval_given = 0 ;
+  args_info->stream_marker_given = 0 ;
 }
 
 static
 void clear_args (struct gengetopt_args_info *args_info)
 {
   FIX_UNUSED (args_info);
+  args_info->input_arg = NULL;
+  args_info->input_orig = NULL;
   args_info->delimiter_arg = NULL;
   args_info->delimiter_orig = NULL;
   args_info->threads_arg = 0;
   args_info->threads_orig = NULL;
+  args_info->work_per_thread_arg = 1;
+  args_info->work_per_thread_orig = NULL;
+  args_info->stats_flag = 0;
+  args_info->pin_threads_flag = 0;
   args_info->level1_arg = gengetopt_strdup ("/");
   args_info->level1_orig = NULL;
   args_info->level2_arg = gengetopt_strdup ("-_ 0123456789");
   args_info->level2_orig = NULL;
   args_info->level3_arg = gengetopt_strdup (".");
   args_info->level3_orig = NULL;
+  args_info->exhaustive_flag = 0;
   args_info->limit_arg = 0;
   args_info->limit_orig = NULL;
+  args_info->min_score_arg = 0;
+  args_info->min_score_orig = NULL;
   args_info->mark_before_arg = NULL;
   args_info->mark_before_orig = NULL;
   args_info->mark_after_arg = NULL;
   args_info->mark_after_orig = NULL;
   args_info->positions_flag = 0;
+  args_info->format_arg = gengetopt_strdup ("plain");
+  args_info->format_orig = NULL;
+  args_info->stream_flag = 0;
+  args_info->refresh_interval_arg = 100;
+  args_info->refresh_interval_orig = NULL;
+  args_info->stream_marker_arg = NULL;
+  args_info->stream_marker_orig = NULL;
   
 }
 
@@ -117,15 +154,25 @@ void init_args_info(struct gengetopt_args_info *args_info)
 
   args_info->help_help = gengetopt_args_info_help[0] ;
   args_info->version_help = gengetopt_args_info_help[1] ;
-  args_info->delimiter_help = gengetopt_args_info_help[3] ;
-  args_info->threads_help = gengetopt_args_info_help[4] ;
-  args_info->level1_help = gengetopt_args_info_help[6] ;
-  args_info->level2_help = gengetopt_args_info_help[7] ;
-  args_info->level3_help = gengetopt_args_info_help[8] ;
-  args_info->limit_help = gengetopt_args_info_help[10] ;
-  args_info->mark_before_help = gengetopt_args_info_help[11] ;
-  args_info->mark_after_help = gengetopt_args_info_help[12] ;
-  args_info->positions_help = gengetopt_args_info_help[13] ;
+  args_info->input_help = gengetopt_args_info_help[3] ;
+  args_info->delimiter_help = gengetopt_args_info_help[4] ;
+  args_info->threads_help = gengetopt_args_info_help[5] ;
+  args_info->work_per_thread_help = gengetopt_args_info_help[6] ;
+  args_info->stats_help = gengetopt_args_info_help[7] ;
+  args_info->pin_threads_help = gengetopt_args_info_help[8] ;
+  args_info->level1_help = gengetopt_args_info_help[10] ;
+  args_info->level2_help = gengetopt_args_info_help[11] ;
+  args_info->level3_help = gengetopt_args_info_help[12] ;
+  args_info->exhaustive_help = gengetopt_args_info_help[13] ;
+  args_info->limit_help = gengetopt_args_info_help[15] ;
+  args_info->min_score_help = gengetopt_args_info_help[16] ;
+  args_info->mark_before_help = gengetopt_args_info_help[17] ;
+  args_info->mark_after_help = gengetopt_args_info_help[18] ;
+  args_info->positions_help = gengetopt_args_info_help[19] ;
+  args_info->format_help = gengetopt_args_info_help[20] ;
+  args_info->stream_help = gengetopt_args_info_help[21] ;
+  args_info->refresh_interval_help = gengetopt_args_info_help[22] ;
+  args_info->stream_marker_help = gengetopt_args_info_help[23] ;
   
 }
 
@@ -212,9 +259,12 @@ static void
 cmdline_parser_release (struct gengetopt_args_info *args_info)
 {
   unsigned int i;
+  free_string_field (&(args_info->input_arg));
+  free_string_field (&(args_info->input_orig));
   free_string_field (&(args_info->delimiter_arg));
   free_string_field (&(args_info->delimiter_orig));
   free_string_field (&(args_info->threads_orig));
+  free_string_field (&(args_info->work_per_thread_orig));
   free_string_field (&(args_info->level1_arg));
   free_string_field (&(args_info->level1_orig));
   free_string_field (&(args_info->level2_arg));
@@ -222,10 +272,16 @@ cmdline_parser_release (struct gengetopt_args_info *args_info)
   free_string_field (&(args_info->level3_arg));
   free_string_field (&(args_info->level3_orig));
   free_string_field (&(args_info->limit_orig));
+  free_string_field (&(args_info->min_score_orig));
   free_string_field (&(args_info->mark_before_arg));
   free_string_field (&(args_info->mark_before_orig));
   free_string_field (&(args_info->mark_after_arg));
   free_string_field (&(args_info->mark_after_orig));
+  free_string_field (&(args_info->format_arg));
+  free_string_field (&(args_info->format_orig));
+  free_string_field (&(args_info->refresh_interval_orig));
+  free_string_field (&(args_info->stream_marker_arg));
+  free_string_field (&(args_info->stream_marker_orig));
   
   
   for (i = 0; i < args_info->inputs_num; ++i)
@@ -265,24 +321,44 @@ cmdline_parser_dump(FILE *outfile, struct gengetopt_args_info *args_info)
     write_into_file(outfile, "help", 0, 0 );
   if (args_info->version_given)
     write_into_file(outfile, "version", 0, 0 );
+  if (args_info->input_given)
+    write_into_file(outfile, "input", args_info->input_orig, 0);
   if (args_info->delimiter_given)
     write_into_file(outfile, "delimiter", args_info->delimiter_orig, 0);
   if (args_info->threads_given)
     write_into_file(outfile, "threads", args_info->threads_orig, 0);
+  if (args_info->work_per_thread_given)
+    write_into_file(outfile, "work-per-thread", args_info->work_per_thread_orig, 0);
+  if (args_info->stats_given)
+    write_into_file(outfile, "stats", 0, 0 );
+  if (args_info->pin_threads_given)
+    write_into_file(outfile, "pin-threads", 0, 0 );
   if (args_info->level1_given)
     write_into_file(outfile, "level1", args_info->level1_orig, 0);
   if (args_info->level2_given)
     write_into_file(outfile, "level2", args_info->level2_orig, 0);
   if (args_info->level3_given)
     write_into_file(outfile, "level3", args_info->level3_orig, 0);
+  if (args_info->exhaustive_given)
+    write_into_file(outfile, "exhaustive", 0, 0 );
   if (args_info->limit_given)
     write_into_file(outfile, "limit", args_info->limit_orig, 0);
+  if (args_info->min_score_given)
+    write_into_file(outfile, "min-score", args_info->min_score_orig, 0);
   if (args_info->mark_before_given)
     write_into_file(outfile, "mark-before", args_info->mark_before_orig, 0);
   if (args_info->mark_after_given)
     write_into_file(outfile, "mark-after", args_info->mark_after_orig, 0);
   if (args_info->positions_given)
     write_into_file(outfile, "positions", 0, 0 );
+  if (args_info->format_given)
+    write_into_file(outfile, "format", args_info->format_orig, 0);
+  if (args_info->stream_given)
+    write_into_file(outfile, "stream", 0, 0 );
+  if (args_info->refresh_interval_given)
+    write_into_file(outfile, "refresh-interval", args_info->refresh_interval_orig, 0);
+  if (args_info->stream_marker_given)
+    write_into_file(outfile, "stream-marker", args_info->stream_marker_orig, 0);
   
 
   i = EXIT_SUCCESS;
@@ -1047,6 +1123,9 @@ int update_arg(void *field, char **orig_field,
   case ARG_INT:
     if (val) *((int *)field) = strtol (val, &stop_char, 0);
     break;
+  case ARG_DOUBLE:
+    if (val) *((double *)field) = strtod (val, &stop_char);
+    break;
   case ARG_STRING:
     if (val) {
       string_field = (char **)field;
@@ -1062,6 +1141,7 @@ int update_arg(void *field, char **orig_field,
   /* check numeric conversion */
   switch(arg_type) {
   case ARG_INT:
+  case ARG_DOUBLE:
     if (val && !(stop_char && *stop_char == '\0')) {
       fprintf(stderr, "%s: invalid numeric value: %s\n", package_name, val);
       return 1; /* failure */
@@ -1136,15 +1216,25 @@ cmdline_parser_internal (
       static struct option long_options[] = {
         { "help",	0, NULL, 'h' },
         { "version",	0, NULL, 'V' },
+        { "input",	1, NULL, 'i' },
         { "delimiter",	1, NULL, 'd' },
         { "threads",	1, NULL, 't' },
+        { "work-per-thread",	1, NULL, 0 },
+        { "stats",	0, NULL, 0 },
+        { "pin-threads",	0, NULL, 0 },
         { "level1",	1, NULL, '1' },
         { "level2",	1, NULL, '2' },
         { "level3",	1, NULL, '3' },
+        { "exhaustive",	0, NULL, 0 },
         { "limit",	1, NULL, 'l' },
+        { "min-score",	1, NULL, 0 },
         { "mark-before",	1, NULL, 'b' },
         { "mark-after",	1, NULL, 'a' },
         { "positions",	0, NULL, 'p' },
+        { "format",	1, NULL, 0 },
+        { "stream",	0, NULL, 0 },
+        { "refresh-interval",	1, NULL, 0 },
+        { "stream-marker",	1, NULL, 0 },
         { 0,  0, 0, 0 }
       };
 
@@ -1153,7 +1243,7 @@ cmdline_parser_internal (
       custom_opterr = opterr;
       custom_optopt = optopt;
 
-      c = custom_getopt_long (argc, argv, "hVd:t:1:2:3:l:b:a:p", long_options, &option_index);
+      c = custom_getopt_long (argc, argv, "hVi:d:t:1:2:3:l:b:a:p", long_options, &option_index);
 
       optarg = custom_optarg;
       optind = custom_optind;
@@ -1183,6 +1273,18 @@ cmdline_parser_internal (
           cmdline_parser_free (&local_args_info);
           exit (EXIT_SUCCESS);
 
+        case 'i':	/* Read the lines from the specified file instead of STDIN. The file is memory mapped and ASCII lines are used in place, without copying. Files compressed with gzip, bzip2 or zstd are recognized and decompressed in a separate thread, while the lines are scored..  */
+        
+        
+          if (update_arg( (void *)&(args_info->input_arg), 
+               &(args_info->input_orig), &(args_info->input_given),
+              &(local_args_info.input_given), optarg, 0, 0, ARG_STRING,
+              check_ambiguity, override, 0, 0,
+              "input", 'i',
+              additional_error))
+            goto failure;
+        
+          break;
         case 'd':	/* The character at which to split the input into lines. Defaults to the new line character..  */
         
         
@@ -1195,7 +1297,7 @@ cmdline_parser_internal (
             goto failure;
         
           break;
-        case 't':	/* Number of worker threads to use. Default is to use the number of available CPUs.  */
+        case 't':	/* Maximum number of worker threads to use. Default is to use the number of available CPUs.  */
         
         
           if (update_arg( (void *)&(args_info->threads_arg), 
@@ -1291,6 +1393,126 @@ cmdline_parser_internal (
           break;
 
         case 0:	/* Long option with no short option */
+          /* The amount of scoring work, in milliseconds, that justifies each additional worker thread. The work is estimated by scoring a sample of the input. The default is about ten times the cost of starting a thread and handing it a task. Zero uses all threads..  */
+          if (strcmp (long_options[option_index].name, "work-per-thread") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->work_per_thread_arg), 
+                 &(args_info->work_per_thread_orig), &(args_info->work_per_thread_given),
+                &(local_args_info.work_per_thread_given), optarg, 0, "1", ARG_DOUBLE,
+                check_ambiguity, override, 0, 0,
+                "work-per-thread", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Print statistics about the work done by each worker thread to STDERR.  */
+          else if (strcmp (long_options[option_index].name, "stats") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->stats_flag), 0, &(args_info->stats_given),
+                &(local_args_info.stats_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "stats", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Pin each worker thread to its own CPU. On NUMA systems this keeps the memory each worker allocates for scoring local to it..  */
+          else if (strcmp (long_options[option_index].name, "pin-threads") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->pin_threads_flag), 0, &(args_info->pin_threads_given),
+                &(local_args_info.pin_threads_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "pin-threads", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Find the best match by enumerating every possible alignment of the query, instead of using dynamic programming. Much slower, useful only for testing..  */
+          else if (strcmp (long_options[option_index].name, "exhaustive") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->exhaustive_flag), 0, &(args_info->exhaustive_given),
+                &(local_args_info.exhaustive_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "exhaustive", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Only return results with at least this score. Candidates that cannot reach it are abandoned as early as possible. A result that consists of just the query scores a little under one..  */
+          else if (strcmp (long_options[option_index].name, "min-score") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->min_score_arg), 
+                 &(args_info->min_score_orig), &(args_info->min_score_given),
+                &(local_args_info.min_score_given), optarg, 0, "0", ARG_DOUBLE,
+                check_ambiguity, override, 0, 0,
+                "min-score", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* The format of the output, either plain, the lines, with --mark-before, --mark-after and --positions applied, or jsonl, a JSON object per line, with the keys: line, index, the number of the line in the input, counting from zero, score and positions, the positions of the matched characters..  */
+          else if (strcmp (long_options[option_index].name, "format") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->format_arg), 
+                 &(args_info->format_orig), &(args_info->format_given),
+                &(local_args_info.format_given), optarg, 0, "plain", ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "format", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Output the best --limit results found so far periodically, while the input is still being read, each time followed by the --stream-marker. The scores of the lines already read are kept, so each refresh only scores the new lines. Without --limit, the best 100 results are output..  */
+          else if (strcmp (long_options[option_index].name, "stream") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->stream_flag), 0, &(args_info->stream_given),
+                &(local_args_info.stream_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "stream", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* The time, in milliseconds, between refreshes of the results with --stream..  */
+          else if (strcmp (long_options[option_index].name, "refresh-interval") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->refresh_interval_arg), 
+                 &(args_info->refresh_interval_orig), &(args_info->refresh_interval_given),
+                &(local_args_info.refresh_interval_given), optarg, 0, "100", ARG_DOUBLE,
+                check_ambiguity, override, 0, 0,
+                "refresh-interval", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* The line output after the results of every refresh with --stream, the last of which are the final results. Defaults to an empty line, which is never a result..  */
+          else if (strcmp (long_options[option_index].name, "stream-marker") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->stream_marker_arg), 
+                 &(args_info->stream_marker_orig), &(args_info->stream_marker_given),
+                &(local_args_info.stream_marker_given), optarg, 0, 0, ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "stream-marker", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          
+          break;
         case '?':	/* Invalid option.  */
           /* `getopt_long' already printed an error message.  */
           goto failure;
@@ -39,12 +39,22 @@ struct gengetopt_args_info
 {
   const char *help_help; /**< @brief Print help and exit help description.  */
   const char *version_help; /**< @brief Print version and exit help description.  */
+  char * input_arg;	/**< @brief Read the lines from the specified file instead of STDIN. The file is memory mapped and ASCII lines are used in place, without copying. Files compressed with gzip, bzip2 or zstd are recognized and decompressed in a separate thread, while the lines are scored..  */
+  char * input_orig;	/**< @brief Read the lines from the specified file instead of STDIN. The file is memory mapped and ASCII lines are used in place, without copying. Files compressed with gzip, bzip2 or zstd are recognized and decompressed in a separate thread, while the lines are scored. original value given at command line.  */
+  const char *input_help; /**< @brief Read the lines from the specified file instead of STDIN. The file is memory mapped and ASCII lines are used in place, without copying. Files compressed with gzip, bzip2 or zstd are recognized and decompressed in a separate thread, while the lines are scored. help description.  */
   char * delimiter_arg;	/**< @brief The character at which to split the input into lines. Defaults to the new line character..  */
   char * delimiter_orig;	/**< @brief The character at which to split the input into lines. Defaults to the new line character. original value given at command line.  */
   const char *delimiter_help; /**< @brief The character at which to split the input into lines. Defaults to the new line character. help description.  */
-  int threads_arg;	/**< @brief Number of worker threads to use. Default is to use the number of available CPUs (default='0').  */
-  char * threads_orig;	/**< @brief Number of worker threads to use. Default is to use the number of available CPUs original value given at command line.  */
-  const char *threads_help; /**< @brief Number of worker threads to use. Default is to use the number of available CPUs help description.  */
+  int threads_arg;	/**< @brief Maximum number of worker threads to use. Default is to use the number of available CPUs (default='0').  */
+  char * threads_orig;	/**< @brief Maximum number of worker threads to use. Default is to use the number of available CPUs original value given at command line.  */
+  const char *threads_help; /**< @brief Maximum number of worker threads to use. Default is to use the number of available CPUs help description.  */
+  double work_per_thread_arg;	/**< @brief The amount of scoring work, in milliseconds, that justifies each additional worker thread. The work is estimated by scoring a sample of the input. The default is about ten times the cost of starting a thread and handing it a task. Zero uses all threads. (default='1').  */
+  char * work_per_thread_orig;	/**< @brief The amount of scoring work, in milliseconds, that justifies each additional worker thread. The work is estimated by scoring a sample of the input. The default is about ten times the cost of starting a thread and handing it a task. Zero uses all threads. original value given at command line.  */
+  const char *work_per_thread_help; /**< @brief The amount of scoring work, in milliseconds, that justifies each additional worker thread. The work is estimated by scoring a sample of the input. The default is about ten times the cost of starting a thread and handing it a task. Zero uses all threads. help description.  */
+  int stats_flag;	/**< @brief Print statistics about the work done by each worker thread to STDERR (default=off).  */
+  const char *stats_help; /**< @brief Print statistics about the work done by each worker thread to STDERR help description.  */
+  int pin_threads_flag;	/**< @brief Pin each worker thread to its own CPU. On NUMA systems this keeps the memory each worker allocates for scoring local to it. (default=off).  */
+  const char *pin_threads_help; /**< @brief Pin each worker thread to its own CPU. On NUMA systems this keeps the memory each worker allocates for scoring local to it. help description.  */
   char * level1_arg;	/**< @brief The level 1 special characters. (default='/').  */
   char * level1_orig;	/**< @brief The level 1 special characters. original value given at command line.  */
   const char *level1_help; /**< @brief The level 1 special characters. help description.  */
@@ -54,9 +64,14 @@ struct gengetopt_args_info
   char * level3_arg;	/**< @brief The level 3 special characters. (default='.').  */
   char * level3_orig;	/**< @brief The level 3 special characters. original value given at command line.  */
   const char *level3_help; /**< @brief The level 3 special characters. help description.  */
+  int exhaustive_flag;	/**< @brief Find the best match by enumerating every possible alignment of the query, instead of using dynamic programming. Much slower, useful only for testing. (default=off).  */
+  const char *exhaustive_help; /**< @brief Find the best match by enumerating every possible alignment of the query, instead of using dynamic programming. Much slower, useful only for testing. help description.  */
   int limit_arg;	/**< @brief Limit the number of returned results. (default='0').  */
   char * limit_orig;	/**< @brief Limit the number of returned results. original value given at command line.  */
   const char *limit_help; /**< @brief Limit the number of returned results. help description.  */
+  double min_score_arg;	/**< @brief Only return results with at least this score. Candidates that cannot reach it are abandoned as early as possible. A result that consists of just the query scores a little under one. (default='0').  */
+  char * min_score_orig;	/**< @brief Only return results with at least this score. Candidates that cannot reach it are abandoned as early as possible. A result that consists of just the query scores a little under one. original value given at command line.  */
+  const char *min_score_help; /**< @brief Only return results with at least this score. Candidates that cannot reach it are abandoned as early as possible. A result that consists of just the query scores a little under one. help description.  */
   char * mark_before_arg;	/**< @brief String to output before each matched character.  */
   char * mark_before_orig;	/**< @brief String to output before each matched character original value given at command line.  */
   const char *mark_before_help; /**< @brief String to output before each matched character help description.  */
@@ -65,18 +80,39 @@ struct gengetopt_args_info
   const char *mark_after_help; /**< @brief String to output after each matched character help description.  */
   int positions_flag;	/**< @brief Output match positions in the form <number>,<number>,...: before each result (default=off).  */
   const char *positions_help; /**< @brief Output match positions in the form <number>,<number>,...: before each result help description.  */
+  char * format_arg;	/**< @brief The format of the output, either plain, the lines, with --mark-before, --mark-after and --positions applied, or jsonl, a JSON object per line, with the keys: line, index, the number of the line in the input, counting from zero, score and positions, the positions of the matched characters. (default='plain').  */
+  char * format_orig;	/**< @brief The format of the output, either plain, the lines, with --mark-before, --mark-after and --positions applied, or jsonl, a JSON object per line, with the keys: line, index, the number of the line in the input, counting from zero, score and positions, the positions of the matched characters. original value given at command line.  */
+  const char *format_help; /**< @brief The format of the output, either plain, the lines, with --mark-before, --mark-after and --positions applied, or jsonl, a JSON object per line, with the keys: line, index, the number of the line in the input, counting from zero, score and positions, the positions of the matched characters. help description.  */
+  int stream_flag;	/**< @brief Output the best --limit results found so far periodically, while the input is still being read, each time followed by the --stream-marker. The scores of the lines already read are kept, so each refresh only scores the new lines. Without --limit, the best 100 results are output. (default=off).  */
+  const char *stream_help; /**< @brief Output the best --limit results found so far periodically, while the input is still being read, each time followed by the --stream-marker. The scores of the lines already read are kept, so each refresh only scores the new lines. Without --limit, the best 100 results are output. help description.  */
+  double refresh_interval_arg;	/**< @brief The time, in milliseconds, between refreshes of the results with --stream. (default='100').  */
+  char * refresh_interval_orig;	/**< @brief The time, in milliseconds, between refreshes of the results with --stream. original value given at command line.  */
+  const char *refresh_interval_help; /**< @brief The time, in milliseconds, between refreshes of the results with --stream. help description.  */
+  char * stream_marker_arg;	/**< @brief The line output after the results of every refresh with --stream, the last of which are the final results. Defaults to an empty line, which is never a result..  */
+  char * stream_marker_orig;	/**< @brief The line output after the results of every refresh with --stream, the last of which are the final results. Defaults to an empty line, which is never a result. original value given at command line.  */
+  const char *stream_marker_help; /**< @brief The line output after the results of every refresh with --stream, the last of which are the final results. Defaults to an empty line, which is never a result. help description.  */
   
   unsigned int help_given ;	/**< @brief Whether help was given.  */
   unsigned int version_given ;	/**< @brief Whether version was given.  */
+  unsigned int input_given ;	/**< @brief Whether input was given.  */
   unsigned int delimiter_given ;	/**< @brief Whether delimiter was given.  */
   unsigned int threads_given ;	/**< @brief Whether threads was given.  */
+  unsigned int work_per_thread_given ;	/**< @brief Whether work-per-thread was given.  */
+  unsigned int stats_given ;	/**< @brief Whether stats was given.  */
+  unsigned int pin_threads_given ;	/**< @brief Whether pin-threads was given.  */
   unsigned int level1_given ;	/**< @brief Whether level1 was given.  */
   unsigned int level2_given ;	/**< @brief Whether level2 was given.  */
   unsigned int level3_given ;	/**< @brief Whether level3 was given.  */
+  unsigned int exhaustive_given ;	/**< @brief Whether exhaustive was given.  */
   unsigned int limit_given ;	/**< @brief Whether limit was given.  */
+  unsigned int min_score_given ;	/**< @brief Whether min-score was given.  */
   unsigned int mark_before_given ;	/**< @brief Whether mark-before was given.  */
   unsigned int mark_after_given ;	/**< @brief Whether mark-after was given.  */
   unsigned int positions_given ;	/**< @brief Whether positions was given.  */
+  unsigned int format_given ;	/**< @brief Whether format was given.  */
+  unsigned int stream_given ;	/**< @brief Whether stream was given.  */
+  unsigned int refresh_interval_given ;	/**< @brief Whether refresh-interval was given.  */
+  unsigned int stream_marker_given ;	/**< @brief Whether stream-marker was given.  */
 
   char **inputs ; /**< @brief unamed options (options without names) */
   unsigned inputs_num ; /**< @brief unamed options number */
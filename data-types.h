@@ -33,10 +33,11 @@ typedef SSIZE_T ssize_t;
 
 typedef struct gengetopt_args_info args_info;
 
-typedef uint8_t len_t;
+typedef uint32_t len_t;
 typedef uint32_t text_t;
 
-#define LEN_MAX UINT8_MAX
+#define LEN_MAX INT32_MAX  // Leaves room for arithmetic on lengths and positions without overflow
+#define LEVEL_MAX UINT8_MAX
 #define UNUSED(x) (void)(x)
 #define UTF8_ACCEPT 0
 #define UTF8_REJECT 1
@@ -45,41 +46,90 @@ typedef uint32_t text_t;
 #define LOWERCASE(x) ((IS_UPPERCASE(x)) ? (x) + 32 : (x))
 
 typedef struct {
-    text_t* src;
+    void* src;  // The raw bytes of the line if it is pure ASCII, otherwise its decoded text_t characters
+    char *raw;  // The raw bytes of a line that is not pure ASCII, if it is valid UTF-8, otherwise NULL
+    size_t raw_sz;
+    bool is_ascii;
     ssize_t src_sz;
     len_t haystack_len;
-    len_t *positions;
+    void *positions;  // The match positions, stored as uint8_t unless the line is too long for them, see WIDE_POSITIONS()
     double score;
     ssize_t idx;
 } Candidate;
 
+#define LEVEL_TABLE_DENSE_SIZE 256
+#define LEVEL_TABLE_SPARSE_SIZE 1024
+
+typedef struct {
+    uint8_t dense[LEVEL_TABLE_DENSE_SIZE];  // The level factors of characters below LEVEL_TABLE_DENSE_SIZE
+    text_t sparse_chars[LEVEL_TABLE_SPARSE_SIZE];  // An open addressing hash of all other level characters, zero means empty
+    uint8_t sparse_factors[LEVEL_TABLE_SPARSE_SIZE];
+    size_t sparse_count;
+} LevelTable;
+
 typedef struct {
-    Candidate *haystack;
-    size_t haystack_count;
-    text_t level1[LEN_MAX], level2[LEN_MAX], level3[LEN_MAX], needle[LEN_MAX];
+    text_t level1[LEVEL_MAX], level2[LEVEL_MAX], level3[LEVEL_MAX], *needle;
     len_t level1_len, level2_len, level3_len, needle_len;
+    LevelTable level_table;
     size_t haystack_size;
+    bool exhaustive;
+    double min_score;
 } GlobalData;
 
 VECTOR_OF(len_t, Positions)
+
+// Match positions are stored in a single byte each, for all lines short
+// enough, and in a uint32_t each for the others.
+#define WIDE_POSITIONS(c) ((c)->haystack_len > UINT8_MAX)
+#define POSITION_SIZE(c) (WIDE_POSITIONS(c) ? sizeof(uint32_t) : sizeof(uint8_t))
+#define CANDIDATE_POSITION(c, i) (WIDE_POSITIONS(c) ? ((uint32_t*)(c)->positions)[i] : ((uint8_t*)(c)->positions)[i])
 VECTOR_OF(text_t, Chars)
+VECTOR_OF(uint8_t, Bytes)
 VECTOR_OF(Candidate, Candidates)
 
 
-void output_results(Candidate *haystack, size_t count, args_info *opts, len_t needle_len, char delim);
-void* alloc_workspace(len_t max_haystack_len, GlobalData*);
+void output_results(void *pool, Candidate *haystack, size_t count, args_info *opts, len_t needle_len, char delim);
+bool output_top_results(void *pool, Candidate **runs, size_t *run_counts, size_t num_runs, args_info *opts, len_t needle_len, char delim);
+void output_stream_marker(args_info *opts, char delim);
+int cmpscore(const void *a, const void *b);
+void compile_level_table(GlobalData*);
+void* alloc_workspace();
+bool prepare_workspace(void *v, GlobalData*);
+bool fit_workspace(void *v, len_t haystack_len);
 void* free_workspace(void *v);
 double score_item(void *v, text_t *haystack, len_t haystack_len, len_t *match_positions);
-size_t decode_string(char *src, size_t sz, text_t *dest);
+double score_item_bytes(void *v, uint8_t *haystack, len_t haystack_len, len_t *match_positions);
+bool is_ascii(char *src, size_t sz);
+size_t decode_string(char *src, size_t sz, text_t *dest, bool *valid);
 unsigned int encode_codepoint(text_t ch, char* dest);
 size_t unescape(char *src, char *dest, size_t destlen);
 int cpu_count();
-void* alloc_threads(size_t num_threads);
-#ifdef ISWINDOWS
-bool start_thread(void* threads, size_t i, unsigned int (STDCALL *start_routine) (void *), void *arg);
-ssize_t getdelim(char **lineptr, size_t *n, int delim, FILE *stream);
-#else
-bool start_thread(void* threads, size_t i, void *(*start_routine) (void *), void *arg);
-#endif
-void wait_for_thread(void *threads, size_t i);
-void free_threads(void *threads);
+typedef void (*pool_func)(void *arg, size_t worker);
+void* alloc_thread_pool(size_t num_workers, bool pin);
+size_t thread_pool_size(void *pool);
+void run_in_thread_pool(void *pool, pool_func func, void *arg);
+void free_thread_pool(void *pool);
+typedef void (*thread_func)(void *arg);
+void* start_thread(thread_func func, void *arg);
+void join_thread(void *thread);
+void* alloc_monitor();
+void lock_monitor(void *monitor);
+void unlock_monitor(void *monitor);
+void wait_on_monitor(void *monitor);
+void notify_monitor(void *monitor);
+void free_monitor(void *monitor);
+double monotonic_time();
+bool handle_cancel_signals(void (*callback)(void));
+void restore_cancel_signals();
+void cancel_query();
+void* map_file(const char *path, size_t *size);
+void unmap_file(void *addr, size_t size);
+ssize_t read_stdin(char *buf, size_t sz);
+bool stdin_ready(double timeout);
+const char* compression_format(const char *data, size_t size);
+void* alloc_decompressor(char *data, size_t size);
+ssize_t read_decompressed(void *decompressor, char *buf, size_t sz);
+void free_decompressor(void *decompressor);
+size_t stdin_size();
+int current_cpu();
+int cpu_numa_node(int cpu);
@@ -0,0 +1,310 @@
+/*
+ * decompress.c
+ * Copyright (C) 2017 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#include "data-types.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAS_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAS_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef HAS_ZSTD
+#include <zstd.h>
+#endif
+
+// A compressed --input file is decompressed in a thread of its own, into a
+// ring of large buffers that the reader copies the lines out of, so that
+// the decompression overlaps with the splitting into lines and the scoring.
+#define NUM_BUFFERS 4
+#define BUFFER_SIZE (1024u * 1024u)
+// zlib and bzip2 take the size of their input as an unsigned int
+#define MAX_INPUT_CHUNK (1024u * 1024u * 1024u)
+
+typedef enum { NOT_COMPRESSED, GZIP, BZIP2, ZSTD } Format;
+static const char *format_names[] = {NULL, "gzip", "bzip2", "zstd"};
+
+typedef struct {
+    char *data;
+    size_t size, pos;  // The size of the decompressed data in the buffer and how much of it has been read
+} Buffer;
+
+typedef struct {
+    Format format;
+    char *src;
+    size_t src_size;
+    Buffer buffers[NUM_BUFFERS];
+    size_t filled;  // The number of buffers that are full and not yet read
+    size_t next_fill, next_read;  // The buffers the thread and the reader use next
+    bool done, failed;  // Set by the thread when it finishes
+    bool stop;  // Set by the reader when it no longer wants the data
+    void *monitor;  // Guards all of the above, except the data in the buffers
+    void *thread;
+} Decompressor;
+
+static Format
+detect_format(const char *data, size_t size) {
+    const unsigned char *d = (const unsigned char*)data;
+    if (size >= 2 && d[0] == 0x1f && d[1] == 0x8b) return GZIP;
+    if (size >= 4 && d[0] == 'B' && d[1] == 'Z' && d[2] == 'h' && d[3] >= '1' && d[3] <= '9') return BZIP2;
+    if (size >= 4 && d[0] == 0x28 && d[1] == 0xb5 && d[2] == 0x2f && d[3] == 0xfd) return ZSTD;
+    return NOT_COMPRESSED;
+}
+
+const char*
+compression_format(const char *data, size_t size) {
+    // The name of the format data is compressed in, NULL if it is not compressed
+    return format_names[detect_format(data, size)];
+}
+
+static inline char*
+output_buffer(Decompressor *d) {
+    // The next buffer to decompress into, waiting for the reader to read
+    // one if all of them are full, NULL if the reader has stopped
+    char *ans = NULL;
+    lock_monitor(d->monitor);
+    while (d->filled == NUM_BUFFERS && !d->stop) wait_on_monitor(d->monitor);
+    if (!d->stop) ans = d->buffers[d->next_fill].data;
+    unlock_monitor(d->monitor);
+    return ans;
+}
+
+static inline void
+output_ready(Decompressor *d, size_t size) {
+    // Hand the buffer from output_buffer(), holding size bytes, to the reader
+    if (size == 0) return;
+    lock_monitor(d->monitor);
+    d->buffers[d->next_fill].size = size;
+    d->buffers[d->next_fill].pos = 0;
+    d->next_fill = (d->next_fill + 1) % NUM_BUFFERS;
+    d->filled++;
+    notify_monitor(d->monitor);
+    unlock_monitor(d->monitor);
+}
+
+static inline bool
+report_error(Decompressor *d, const char *msg) {
+    fprintf(stderr, "Failed to decompress the %s compressed input: %s\n", format_names[d->format], msg);
+    return false;
+}
+
+#ifdef HAS_ZLIB
+static bool
+gunzip(Decompressor *d) {
+    z_stream s;
+    size_t fed = 0;  // The number of bytes of the input given to zlib so far
+    int ret = Z_OK;
+    char *out;
+    const char *error = NULL;
+    memset(&s, 0, sizeof(s));
+    // Adding 16 to the window bits selects the gzip format
+    if (inflateInit2(&s, 16 + MAX_WBITS) != Z_OK) return report_error(d, "could not initialize zlib");
+    while (ret != Z_STREAM_END && error == NULL && (out = output_buffer(d))) {
+        s.next_out = (Bytef*)out; s.avail_out = BUFFER_SIZE;
+        while (s.avail_out > 0) {
+            if (s.avail_in == 0 && fed < d->src_size) {
+                s.next_in = (Bytef*)d->src + fed; s.avail_in = (uInt)MIN(MAX_INPUT_CHUNK, d->src_size - fed);
+                fed += s.avail_in;
+            }
+            ret = inflate(&s, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                // The input can be several gzip members, one after the other
+                if (s.avail_in == 0 && fed == d->src_size) break;
+                inflateReset(&s); ret = Z_OK;
+            } else if (ret != Z_OK) {
+                error = ret == Z_BUF_ERROR ? "unexpected end of data" : (s.msg ? s.msg : "corrupt data"); break;
+            } else if (s.avail_in == 0 && fed == d->src_size && s.avail_out > 0) {
+                error = "unexpected end of data"; break;
+            }
+        }
+        output_ready(d, BUFFER_SIZE - s.avail_out);
+    }
+    inflateEnd(&s);
+    return error ? report_error(d, error) : true;
+}
+#endif
+
+#ifdef HAS_BZIP2
+static bool
+bunzip2(Decompressor *d) {
+    bz_stream s;
+    size_t fed = 0;  // The number of bytes of the input given to bzip2 so far
+    int ret = BZ_OK;
+    char *out, *next_in, *next_out;
+    unsigned int avail_in, avail_out;
+    const char *error = NULL;
+    memset(&s, 0, sizeof(s));
+    if (BZ2_bzDecompressInit(&s, 0, 0) != BZ_OK) return report_error(d, "could not initialize bzip2");
+    while (ret != BZ_STREAM_END && error == NULL && (out = output_buffer(d))) {
+        s.next_out = out; s.avail_out = BUFFER_SIZE;
+        while (s.avail_out > 0) {
+            if (s.avail_in == 0 && fed < d->src_size) {
+                s.next_in = d->src + fed; s.avail_in = (unsigned int)MIN(MAX_INPUT_CHUNK, d->src_size - fed);
+                fed += s.avail_in;
+            }
+            ret = BZ2_bzDecompress(&s);
+            if (ret == BZ_STREAM_END) {
+                // The input can be several bzip2 streams, one after the
+                // other, as written by parallel compressors
+                if (s.avail_in == 0 && fed == d->src_size) break;
+                next_in = s.next_in; avail_in = s.avail_in; next_out = s.next_out; avail_out = s.avail_out;
+                BZ2_bzDecompressEnd(&s);
+                memset(&s, 0, sizeof(s));
+                if (BZ2_bzDecompressInit(&s, 0, 0) != BZ_OK) { error = "could not initialize bzip2"; break; }
+                s.next_in = next_in; s.avail_in = avail_in; s.next_out = next_out; s.avail_out = avail_out;
+                ret = BZ_OK;
+            } else if (ret != BZ_OK) {
+                error = ret == BZ_MEM_ERROR ? "out of memory" : "corrupt data"; break;
+            } else if (s.avail_in == 0 && fed == d->src_size && s.avail_out > 0) {
+                error = "unexpected end of data"; break;
+            }
+        }
+        output_ready(d, BUFFER_SIZE - s.avail_out);
+    }
+    BZ2_bzDecompressEnd(&s);
+    return error ? report_error(d, error) : true;
+}
+#endif
+
+#ifdef HAS_ZSTD
+static bool
+unzstd(Decompressor *d) {
+    // zstd decompresses several frames, one after the other, by itself
+    ZSTD_DStream *s = ZSTD_createDStream();
+    ZSTD_inBuffer in = {d->src, d->src_size, 0};
+    ZSTD_outBuffer o;
+    size_t ret = 0;
+    bool more = true;
+    char *out;
+    const char *error = NULL;
+    if (s == NULL || ZSTD_isError(ZSTD_initDStream(s))) { ZSTD_freeDStream(s); return report_error(d, "could not initialize zstd"); }
+    while (more && (out = output_buffer(d))) {
+        o.dst = out; o.size = BUFFER_SIZE; o.pos = 0;
+        while (o.pos < o.size) {
+            ret = ZSTD_decompressStream(s, &o, &in);
+            if (ZSTD_isError(ret)) { error = ZSTD_getErrorName(ret); break; }
+            // With all of the input used and room left in the output, no
+            // more output is pending
+            if (in.pos == in.size && o.pos < o.size) { more = false; break; }
+        }
+        output_ready(d, o.pos);
+        if (error) break;
+    }
+    ZSTD_freeDStream(s);
+    if (error == NULL && !more && ret != 0) error = "unexpected end of data";
+    return error ? report_error(d, error) : true;
+}
+#endif
+
+static void
+decompress(void *v) {
+    Decompressor *d = (Decompressor*)v;
+    bool ok = false;
+    switch (d->format) {
+#ifdef HAS_ZLIB
+        case GZIP: ok = gunzip(d); break;
+#endif
+#ifdef HAS_BZIP2
+        case BZIP2: ok = bunzip2(d); break;
+#endif
+#ifdef HAS_ZSTD
+        case ZSTD: ok = unzstd(d); break;
+#endif
+        default: break;
+    }
+    lock_monitor(d->monitor);
+    d->done = true; d->failed = !ok;
+    notify_monitor(d->monitor);
+    unlock_monitor(d->monitor);
+}
+
+static bool
+is_supported(Format format) {
+    switch (format) {
+#ifdef HAS_ZLIB
+        case GZIP: return true;
+#endif
+#ifdef HAS_BZIP2
+        case BZIP2: return true;
+#endif
+#ifdef HAS_ZSTD
+        case ZSTD: return true;
+#endif
+        default: return false;
+    }
+}
+
+void*
+alloc_decompressor(char *data, size_t size) {
+    // Start decompressing data, which must remain valid until
+    // free_decompressor(). Returns NULL, after reporting why, on failure.
+    Decompressor *d;
+    Format format = detect_format(data, size);
+    if (format == NOT_COMPRESSED) { fprintf(stderr, "The input is not compressed\n"); return NULL; }
+    if (!is_supported(format)) { fprintf(stderr, "Reading %s compressed input is not supported by this build\n", format_names[format]); return NULL; }
+    if ((d = (Decompressor*)calloc(1, sizeof(Decompressor))) == NULL) { REPORT_OOM; return NULL; }
+    d->format = format; d->src = data; d->src_size = size;
+    for (size_t i = 0; i < NUM_BUFFERS; i++) {
+        if ((d->buffers[i].data = (char*)malloc(BUFFER_SIZE)) == NULL) { REPORT_OOM; free_decompressor(d); return NULL; }
+    }
+    if ((d->monitor = alloc_monitor()) == NULL) { REPORT_OOM; free_decompressor(d); return NULL; }
+    if ((d->thread = start_thread(decompress, d)) == NULL) { free_decompressor(d); return NULL; }
+    return d;
+}
+
+ssize_t
+read_decompressed(void *v, char *buf, size_t sz) {
+    // Like read(), copies up to sz bytes of the decompressed data into buf,
+    // waiting for the thread if there are none yet. Returns zero at the end
+    // and -1, with errno set, if the data could not be decompressed.
+    Decompressor *d = (Decompressor*)v;
+    Buffer *b;
+    size_t n;
+    bool failed;
+    lock_monitor(d->monitor);
+    while (d->filled == 0 && !d->done) wait_on_monitor(d->monitor);
+    if (d->filled == 0) {
+        failed = d->failed;
+        unlock_monitor(d->monitor);
+        if (failed) { errno = EIO; return -1; }
+        return 0;
+    }
+    b = d->buffers + d->next_read;
+    unlock_monitor(d->monitor);
+    // The thread does not touch a full buffer, until it is read
+    n = MIN(sz, b->size - b->pos);
+    memcpy(buf, b->data + b->pos, n);
+    b->pos += n;
+    if (b->pos == b->size) {
+        lock_monitor(d->monitor);
+        d->next_read = (d->next_read + 1) % NUM_BUFFERS;
+        d->filled--;
+        notify_monitor(d->monitor);
+        unlock_monitor(d->monitor);
+    }
+    return (ssize_t)n;
+}
+
+void
+free_decompressor(void *v) {
+    // Stop the thread, if it is still decompressing, and free everything
+    Decompressor *d = (Decompressor*)v;
+    if (d == NULL) return;
+    if (d->thread) {
+        lock_monitor(d->monitor);
+        d->stop = true;
+        notify_monitor(d->monitor);
+        unlock_monitor(d->monitor);
+        join_thread(d->thread);
+    }
+    free_monitor(d->monitor);
+    for (size_t i = 0; i < NUM_BUFFERS; i++) free(d->buffers[i].data);
+    free(d);
+}
@@ -11,169 +11,697 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <signal.h>
 #include <fcntl.h>
 #ifndef ISWINDOWS
 #include <unistd.h>
 #endif
 
+// Workers store the positions of the matches they score in slabs of their
+// own, so that the positions are placed on the NUMA node the worker runs on
+// and only matches take up space. The slabs live until the next query.
+#define SLAB_SIZE (64u * 1024u)
+
+typedef struct Slab {
+    struct Slab *next;
+    size_t used, capacity;
+    uint32_t data[];
+} Slab;
+
 typedef struct {
-    size_t start, count;
     void *workspace;
-    len_t max_haystack_len;
-    bool started;
+    len_t *match_positions;
+    Slab *slabs;  // The slabs of positions, the one being filled first
+    bool failed;
+    size_t scored, chunks;  // The number of candidates and chunks this worker scored
+    double elapsed;  // The time, in seconds, this worker spent scoring
+    Candidate *top;  // The best top_k candidates this worker has scored, see keep_if_top()
+    size_t top_count, top_capacity;
+    int cpu;  // The CPU this worker last ran on, -1 if not known
 } JobData;
 
 
 static GlobalData global = {0};
 
-static unsigned int STDCALL
-run_scoring(JobData *job_data) {
-    for (size_t i = job_data->start; i < job_data->start + job_data->count; i++) {
-        global.haystack[i].score = score_item(job_data->workspace, global.haystack[i].src, global.haystack[i].haystack_len, global.haystack[i].positions);
-    }
-    return 0;
-}
+// Set by cancel_query(), possibly from a signal handler. The reader checks
+// it for every line and the workers for every candidate, so that a query
+// that is no longer wanted stops using the CPUs right away. A signal
+// handler cannot wake the threads waiting on the input monitor, so the
+// first thread to see the flag does that, see publish_cancel(). It is
+// reset at the start of every query.
+static volatile sig_atomic_t cancelled = 0;
+#define CANCELLED_EXIT_CODE 2
 
-static void*
-run_scoring_pthreads(void *job_data) {
-    run_scoring((JobData*)job_data);
-    return NULL;
+void
+cancel_query() {
+    cancelled = 1;
 }
-#ifdef ISWINDOWS
-#define START_FUNC run_scoring
-#else
-#define START_FUNC run_scoring_pthreads
-#endif
 
-static JobData*
-create_job(size_t i, size_t blocksz) {
-    JobData *ans = (JobData*)calloc(1, sizeof(JobData));
-    if (ans == NULL) return NULL;
-    ans->start = i * blocksz;
-    if (ans->start >= global.haystack_count) ans->count = 0;
-    else ans->count = global.haystack_count - ans->start;
-    ans->max_haystack_len = 0;
-    for (size_t i = ans->start; i < ans->start + ans->count; i++) ans->max_haystack_len = MAX(ans->max_haystack_len, global.haystack[i].haystack_len);
-    if (ans->count > 0) {
-        ans->workspace = alloc_workspace(ans->max_haystack_len, &global);
-        if (!ans->workspace) { free(ans); return NULL; }
-    }
-    return ans;
-}
+// The worker threads and their scoring state are kept for the life of the
+// process and reused for every query, one JobData per worker of the pool.
+static void *pool = NULL;
+static JobData *jobs = NULL;
+static size_t num_jobs = 0;
+// When only the best top_k results are output, every worker keeps just its
+// own best top_k candidates and those are merged at the end, zero means the
+// results are not limited
+static size_t top_k = 0;
+
+// The input is read into blocks of up to BLOCK_SIZE candidates. A block
+// never moves once it is complete, so it is published to the workers right
+// away and scored while the following ones are still being read.
+#define BLOCK_SIZE 2048
+
+typedef struct Block {
+    Candidate candidates[BLOCK_SIZE];
+    size_t count;
+    Chars chars;  // The decoded text of the lines that are not pure ASCII
+    Bytes bytes;  // The lines that are pure ASCII
+    struct Block *next;
+} Block;
+
+// Workers take candidates from the published blocks in chunks of up to this
+// many, so threads that get cheap lines simply take more chunks instead of
+// waiting for the ones that got expensive lines.
+#define CHUNK_SIZE 128
+
+static struct {
+    Block *first, *last;  // The published blocks, in input order
+    Block *current;  // The block the next chunk comes from
+    size_t next;  // The index of the first candidate of the next chunk in current
+    size_t count;  // The number of candidates published so far
+    size_t scored;  // The number of candidates published so far that have been scored
+    bool eof;  // Set once the last block has been published
+    bool refreshing;  // Set while the reader waits for all published candidates to be scored
+    bool cancelled;  // Set once a thread has seen the query cancelled, nothing waits after that
+    void *monitor;  // Guards all of the above
+} input = {0};
+
+// With --stream, the reader outputs the best results so far every interval
+// seconds. A refresh waits only for the lines read since the last one to be
+// scored, then merges the best candidates the workers have kept.
+#define STREAM_LIMIT 100
+
+static struct {
+    double interval, next;  // When the next refresh is due, zero if not streaming
+    size_t shown;  // The number of candidates published at the last refresh
+    args_info *opts;
+} stream = {0};
+
+// STDIN is read in large blocks into an arena, in which the lines are then
+// found with memchr(). A line that is not complete at the end of the arena
+// is moved to its start before the next read, and the arena grows if it
+// cannot hold a single line.
+#define READ_SIZE (256u * 1024u)
 
-static JobData*
-free_job(JobData *job) {
-    if (job) {
-        if (job->workspace) free_workspace(job->workspace);
-        free(job);
+static struct {
+    char delimiter;
+    char *buf;  // The arena of data read from STDIN
+    size_t buf_capacity, buf_start, buf_end;  // The unused data is from buf_start to buf_end
+    size_t buf_scanned;  // The data from buf_start up to here has no delimiter
+    bool stdin_eof;
+    char *map;  // The mapped input file, if any, instead of STDIN
+    size_t map_size, map_pos;
+    void *decompressor;  // Decompresses the mapped file into the arena, instead of STDIN, if it is compressed
+    char *compressed;  // The mapped file, when it is compressed
+    size_t compressed_size;
+    ssize_t idx;  // The index of the next line
+    int ret;
+} reader = {0};
+
+static Block*
+free_block(Block *b) {
+    if (b) {
+        FREE_VEC(b->chars); FREE_VEC(b->bytes);
+        free(b);
     }
     return NULL;
 }
 
+static Block*
+alloc_block() {
+    Block *b = (Block*)calloc(1, sizeof(Block));
+    if (b == NULL) return NULL;
+    ALLOC_VEC(text_t, b->chars, 1024);
+    ALLOC_VEC(uint8_t, b->bytes, 64 * 1024);
+    if (b->chars.data == NULL || b->bytes.data == NULL) return free_block(b);
+    return b;
+}
 
-static int
-run_threaded(int num_threads_asked) {
-    int ret = 0;
-    size_t i, blocksz;
-    size_t num_threads = MAX(1, num_threads_asked > 0 ? num_threads_asked : cpu_count());
-    if (global.haystack_size < 10000) num_threads = 1;
-    /* printf("num_threads: %lu asked: %d sysconf: %ld\n", num_threads, num_threads_asked, sysconf(_SC_NPROCESSORS_ONLN)); */
-
-    void *threads = alloc_threads(num_threads);
-    JobData **job_data = calloc(num_threads, sizeof(JobData*));
-    if (threads == NULL || job_data == NULL) { ret = 1; goto end; }
-
-    blocksz = global.haystack_count / num_threads + global.haystack_count % num_threads;
+static void
+finish_block(Block *b) {
+    // Set up the src pointers to point to the correct locations, now that
+    // the text will not move. The positions are stored by the workers, see
+    // keep_positions().
+    Candidate *haystack = b->candidates;
+    text_t *cdata = &ITEM(b->chars, 0);
+    uint8_t *bdata = &ITEM(b->bytes, 0);
+    for (size_t i = 0, off = 0, boff = 0; i < b->count; i++) {
+        haystack[i].positions = NULL;
+        // With a mapped file, the raw bytes are used in place
+        if (haystack[i].is_ascii) {
+            if (reader.map) continue;
+            haystack[i].src = bdata + boff;
+            boff += haystack[i].src_sz;
+        } else {
+            haystack[i].src = cdata + off;
+            off += haystack[i].src_sz;
+            if (haystack[i].raw_sz && !reader.map) { haystack[i].raw = (char*)bdata + boff; boff += haystack[i].raw_sz; }
+        }
+    }
+}
 
-    for (i = 0; i < num_threads; i++) {
-        job_data[i] = create_job(i, blocksz);
-        if (job_data[i] == NULL) { ret = 1; goto end; }
+static void
+publish_block(Block *b, bool eof) {
+    lock_monitor(input.monitor);
+    if (b) {
+        if (input.last) input.last->next = b;
+        else input.first = b;
+        input.last = b;
+        if (input.current == NULL) { input.current = b; input.next = 0; }
+        input.count += b->count;
     }
+    input.eof = eof;
+    notify_monitor(input.monitor);
+    unlock_monitor(input.monitor);
+}
 
-    if (num_threads == 1) {
-        run_scoring(job_data[0]);
-    } else {
-        for (i = 0; i < num_threads; i++) {
-            job_data[i]->started = false;
-            if (job_data[i]->count > 0) {
-                if (!start_thread(threads, i, START_FUNC, job_data[i])) ret = 1;
-                else job_data[i]->started = true;
-            }
+static void
+publish_cancel() {
+    // Wake every thread waiting on the input, for a cancelled query
+    lock_monitor(input.monitor);
+    input.cancelled = true;
+    notify_monitor(input.monitor);
+    unlock_monitor(input.monitor);
+}
+
+static Candidate*
+next_chunk(size_t scored, size_t *count, bool wait) {
+    // The next chunk of candidates to score, waiting for the reader if
+    // necessary, or NULL once all of the input has been handed out. scored
+    // is the size of the previous chunk, which is now scored.
+    Candidate *ans = NULL;
+    lock_monitor(input.monitor);
+    input.scored += scored;
+    if (input.refreshing && input.scored == input.count) notify_monitor(input.monitor);
+    while (true) {
+        if (input.current && input.next < input.current->count) {
+            ans = input.current->candidates + input.next;
+            *count = MIN(CHUNK_SIZE, input.current->count - input.next);
+            input.next += *count;
+            break;
         }
+        if (input.current && input.current->next) { input.current = input.current->next; input.next = 0; continue; }
+        if (input.eof || input.cancelled || cancelled || !wait) break;
+        wait_on_monitor(input.monitor);
     }
+    unlock_monitor(input.monitor);
+    return ans;
+}
 
-end:
-    if (num_threads > 1 && job_data) {
-        for (i = 0; i < num_threads; i++) {
-            if (job_data[i] && job_data[i]->started) wait_for_thread(threads, i);
+static ssize_t
+next_line_from_stdin(char **line) {
+    char *end, *buf;
+    ssize_t sz;
+    size_t capacity;
+    while (true) {
+        end = reader.buf_scanned < reader.buf_end ? (char*)memchr(reader.buf + reader.buf_scanned, reader.delimiter, reader.buf_end - reader.buf_scanned) : NULL;
+        if (end || (reader.stdin_eof && reader.buf_start < reader.buf_end)) {
+            *line = reader.buf + reader.buf_start;
+            sz = end ? end - *line + 1 : (ssize_t)(reader.buf_end - reader.buf_start);
+            reader.buf_start += sz; reader.buf_scanned = reader.buf_start;
+            return sz;
+        }
+        if (reader.stdin_eof) return -1;
+        // When streaming, the lines read so far are not held back by a
+        // producer that is slow to write the next ones
+        if (stream.interval > 0 && !reader.decompressor && !stdin_ready(stream.next - monotonic_time())) { errno = EAGAIN; return -1; }
+        reader.buf_scanned = reader.buf_end;
+        if (reader.buf_start > 0) {
+            memmove(reader.buf, reader.buf + reader.buf_start, reader.buf_end - reader.buf_start);
+            reader.buf_end -= reader.buf_start; reader.buf_scanned -= reader.buf_start; reader.buf_start = 0;
+        }
+        if (reader.buf_capacity - reader.buf_end < READ_SIZE / 2) {
+            capacity = MAX(READ_SIZE, 2 * reader.buf_capacity);
+            if ((buf = (char*)realloc(reader.buf, capacity)) == NULL) { errno = ENOMEM; return -1; }
+            reader.buf = buf; reader.buf_capacity = capacity;
         }
+        if (reader.decompressor) sz = read_decompressed(reader.decompressor, reader.buf + reader.buf_end, reader.buf_capacity - reader.buf_end);
+        else sz = read_stdin(reader.buf + reader.buf_end, reader.buf_capacity - reader.buf_end);
+        if (sz < 0) return -1;
+        if (sz == 0) reader.stdin_eof = true;
+        reader.buf_end += sz;
     }
-    for (i = 0; i < num_threads; i++) job_data[i] = free_job(job_data[i]);
-    free(job_data);
-    free_threads(threads); 
-    return ret;
 }
 
+static ssize_t
+next_line(char **line) {
+    // The next line, including its delimiter, either from the mapped file
+    // or read from STDIN, or the decompressor, into the arena
+    char *end;
+    ssize_t sz;
+    if (reader.map == NULL) return next_line_from_stdin(line);
+    if (reader.map_pos >= reader.map_size) return -1;
+    *line = reader.map + reader.map_pos;
+    end = (char*)memchr(*line, reader.delimiter, reader.map_size - reader.map_pos);
+    sz = end ? end - *line + 1 : (ssize_t)(reader.map_size - reader.map_pos);
+    reader.map_pos += sz;
+    return sz;
+}
 
-static int 
-read_stdin(args_info *opts, char delimiter) {
-    char *linebuf = NULL;
-    size_t n = 0, idx = 0;
+static int
+read_block(Block *b, bool *eof) {
+    // Read lines into b, until it is full or the input ends, or when
+    // streaming, until a refresh is due
     ssize_t sz = 0;
     int ret = 0;
-    Candidates candidates = {0};
-    Chars chars = {0};
+    char *linebuf;
+    Candidate *c;
+    bool valid;
 
-    ALLOC_VEC(text_t, chars, 8192 * 20);
-    ALLOC_VEC(Candidate, candidates, 8192);
-    if (chars.data == NULL || candidates.data == NULL) return 1;
-
-    while (true) {
+    while (b->count < BLOCK_SIZE) {
+        if (cancelled) { publish_cancel(); *eof = true; break; }
+        if (stream.interval > 0 && b->count > 0 && monotonic_time() >= stream.next) break;
         errno = 0;
-        sz = getdelim(&linebuf, &n, delimiter, stdin);
+        sz = next_line(&linebuf);
         if (sz < 1) {
+            if (errno == EINTR) continue;  // a cancel is seen at the top of the loop
+            if (errno == EAGAIN) break;
             if (errno != 0) {
-                perror("Failed to read from STDIN with error:"); 
+                perror("Failed to read the input with error");
                 ret = 1;
             }
+            *eof = true;
             break;
         }
+        // Lines are numbered from zero, counting the ones that are skipped
+        reader.idx++;
         if (sz > 1) {
-            if (linebuf[sz - 1] == '\n') linebuf[--sz] = 0;
+            if (linebuf[sz - 1] == '\n') sz--;
             if (sz > 0) {
-                ENSURE_SPACE(text_t, chars, sz);
-                ENSURE_SPACE(Candidate, candidates, 1);
-                sz = decode_string(linebuf, sz, &(NEXT(chars)));
-                NEXT(candidates).src_sz = sz;
-                NEXT(candidates).haystack_len = (len_t)(MIN(LEN_MAX, sz));
-                global.haystack_size += NEXT(candidates).haystack_len;
-                NEXT(candidates).idx = idx++;
-                INC(candidates, 1); INC(chars, sz); 
+                c = b->candidates + b->count;
+                c->is_ascii = is_ascii(linebuf, sz);
+                if (c->is_ascii && reader.map) {
+                    // ASCII lines are scored and output in place
+                    c->src = linebuf;
+                } else if (c->is_ascii) {
+                    // ASCII lines are scored and output as is, with no decoding
+                    ENSURE_SPACE(uint8_t, b->bytes, sz);
+                    memcpy(&(NEXT(b->bytes)), linebuf, sz);
+                    INC(b->bytes, sz);
+                } else {
+                    // Valid lines keep their raw bytes as well, for output
+                    ENSURE_SPACE(text_t, b->chars, sz);
+                    c->raw_sz = sz;
+                    sz = decode_string(linebuf, sz, &(NEXT(b->chars)), &valid);
+                    INC(b->chars, sz);
+                    if (!valid) c->raw_sz = 0;
+                    else if (reader.map) c->raw = linebuf;
+                    else {
+                        ENSURE_SPACE(uint8_t, b->bytes, c->raw_sz);
+                        memcpy(&(NEXT(b->bytes)), linebuf, c->raw_sz);
+                        INC(b->bytes, c->raw_sz);
+                    }
+                }
+                c->src_sz = sz;
+                c->haystack_len = (len_t)(MIN(LEN_MAX, sz));
+                global.haystack_size += c->haystack_len;
+                c->idx = reader.idx - 1;
+                b->count++;
             }
         }
     }
+    if (ret == 0) finish_block(b);
+    return ret;
+}
 
-    // Prepare the haystack allocating space for positions arrays and settings
-    // up the src pointers to point to the correct locations
-    Candidate *haystack = &ITEM(candidates, 0);
-    len_t *positions = (len_t*)calloc(SIZE(candidates), sizeof(len_t) * global.needle_len);
-    if (positions) {
-        text_t *cdata = &ITEM(chars, 0);
-        for (size_t i = 0, off = 0; i < SIZE(candidates); i++) {
-            haystack[i].positions = positions + (i * global.needle_len);
-            haystack[i].src = cdata + off;
-            off += haystack[i].src_sz;
+static inline void
+store_positions(Candidate *c, len_t *match_positions) {
+    if (WIDE_POSITIONS(c)) { for (len_t p = 0; p < global.needle_len; p++) ((uint32_t*)c->positions)[p] = match_positions[p]; }
+    else { for (len_t p = 0; p < global.needle_len; p++) ((uint8_t*)c->positions)[p] = (uint8_t)match_positions[p]; }
+}
+
+static bool
+keep_positions(JobData *job, Candidate *c, len_t *match_positions) {
+    // Store the positions of c in the slab being filled, or in a new one
+    size_t words = WIDE_POSITIONS(c) ? global.needle_len : (global.needle_len + 3) / 4;
+    Slab *slab = job->slabs;
+    if (slab == NULL || slab->capacity - slab->used < words) {
+        size_t capacity = MAX(SLAB_SIZE / sizeof(uint32_t), words);
+        if ((slab = (Slab*)malloc(sizeof(Slab) + capacity * sizeof(uint32_t))) == NULL) return false;
+        slab->next = job->slabs; slab->used = 0; slab->capacity = capacity;
+        job->slabs = slab;
+    }
+    c->positions = slab->data + slab->used;
+    slab->used += words;
+    store_positions(c, match_positions);
+    return true;
+}
+
+static void
+free_slabs(JobData *job) {
+    Slab *next;
+    for (; job->slabs; job->slabs = next) { next = job->slabs->next; free(job->slabs); }
+}
+
+static bool
+keep_if_top(JobData *job, Candidate *c, len_t *match_positions) {
+    // Keep a copy of c if it is among the best top_k candidates this worker
+    // has seen. They are kept in a heap with the worst of them at the root,
+    // each with its own positions buffer, that is reused by whatever
+    // candidate replaces it.
+    Candidate *heap = job->top;
+    void *positions;
+    size_t i, parent, child;
+    if (job->top_count < top_k) {
+        if (job->top_count >= job->top_capacity) {
+            size_t capacity = MIN(top_k, MAX(64, 2 * job->top_capacity));
+            if ((heap = (Candidate*)realloc(job->top, capacity * sizeof(Candidate))) == NULL) return false;
+            job->top = heap; job->top_capacity = capacity;
         }
-        global.haystack = haystack;
-        global.haystack_count = SIZE(candidates);
-        ret = run_threaded(opts->threads_arg);
-        if (ret == 0) output_results(haystack, SIZE(candidates), opts, global.needle_len, delimiter);
-        else { REPORT_OOM; }
-    } else { ret = 1; REPORT_OOM; }
-
-    if (linebuf) free(linebuf);
-    linebuf = NULL;
-    FREE_VEC(chars); free(positions); FREE_VEC(candidates);
+        if ((positions = malloc(global.needle_len * sizeof(uint32_t))) == NULL) return false;
+        for (i = job->top_count++; i > 0; i = parent) {
+            parent = (i - 1) / 2;
+            if (cmpscore(c, heap + parent) <= 0) break;
+            heap[i] = heap[parent];
+        }
+    } else {
+        if (cmpscore(c, heap) >= 0) return true;
+        positions = heap[0].positions;
+        for (i = 0; (child = 2 * i + 1) < job->top_count; i = child) {
+            if (child + 1 < job->top_count && cmpscore(heap + child + 1, heap + child) > 0) child++;
+            if (cmpscore(heap + child, c) <= 0) break;
+            heap[i] = heap[child];
+        }
+    }
+    heap[i] = *c;
+    heap[i].positions = positions;
+    store_positions(heap + i, match_positions);
+    return true;
+}
+
+static void
+free_top(JobData *job) {
+    for (size_t i = 0; i < job->top_count; i++) free(job->top[i].positions);
+    job->top_count = 0;
+}
+
+static void
+score_chunk(JobData *job_data, Candidate *chunk, size_t count) {
+    Candidate *c;
+    len_t *match_positions = job_data->match_positions;
+    double started_at = monotonic_time();
+    for (size_t i = 0; i < count && !cancelled; i++) {
+        c = chunk + i;
+        if (!fit_workspace(job_data->workspace, c->haystack_len)) { job_data->failed = true; c->score = 0; continue; }
+        if (c->is_ascii) c->score = score_item_bytes(job_data->workspace, c->src, c->haystack_len, match_positions);
+        else c->score = score_item(job_data->workspace, c->src, c->haystack_len, match_positions);
+        if (c->score < 0) { job_data->failed = true; c->score = 0; }
+        else if (c->score > 0) {
+            if (!top_k) { if (!keep_positions(job_data, c, match_positions)) job_data->failed = true; }
+            else if (!keep_if_top(job_data, c, match_positions)) job_data->failed = true;
+        }
+    }
+    if (cancelled) publish_cancel();
+    job_data->scored += count;
+    job_data->chunks++;
+    job_data->elapsed += monotonic_time() - started_at;
+}
+
+static void
+run_scoring(void *unused, size_t worker) {
+    (void)unused;
+    JobData *job_data = jobs + worker;
+    Candidate *chunk;
+    size_t count = 0;
+    while ((chunk = next_chunk(count, &count, true))) score_chunk(job_data, chunk, count);
+    if (top_k && job_data->top_count) qsort(job_data->top, job_data->top_count, sizeof(Candidate), cmpscore);
+    job_data->cpu = current_cpu();
+}
+
+static void
+output_refresh(JobData *job_data) {
+    // Output the best results among the candidates published so far. The
+    // reader helps to score them, then waits for the workers to finish the
+    // chunks they have taken. The workers are then all waiting for input,
+    // so the candidates they keep can be read safely.
+    Candidate *chunk, *results;
+    size_t count = 0, num_results = 0, i;
+    while ((chunk = next_chunk(count, &count, false))) score_chunk(job_data, chunk, count);
+    lock_monitor(input.monitor);
+    input.refreshing = true;
+    while (input.scored < input.count && !input.cancelled) wait_on_monitor(input.monitor);
+    input.refreshing = false;
+    unlock_monitor(input.monitor);
+    stream.next = monotonic_time() + stream.interval;
+    if (cancelled || input.count == stream.shown) return;
+    stream.shown = input.count;
+    for (i = 0; i < thread_pool_size(pool); i++) num_results += jobs[i].top_count;
+    if ((results = (Candidate*)malloc((num_results + 1) * sizeof(Candidate))) == NULL) { job_data->failed = true; return; }
+    for (i = 0, num_results = 0; i < thread_pool_size(pool); i++) {
+        if (jobs[i].top_count) memcpy(results + num_results, jobs[i].top, jobs[i].top_count * sizeof(Candidate));
+        num_results += jobs[i].top_count;
+    }
+    output_results(NULL, results, num_results, stream.opts, global.needle_len, reader.delimiter);
+    output_stream_marker(stream.opts, reader.delimiter);
+    free(results);
+}
+
+static void
+read_rest() {
+    // Read and publish blocks until the input ends. The end is always
+    // published, even after an error, so that the workers finish. When
+    // streaming, the results so far are output whenever a refresh is due.
+    bool eof = false;
+    Block *b;
+    while (!eof) {
+        if (stream.interval > 0 && monotonic_time() >= stream.next) output_refresh(jobs);
+        if ((b = alloc_block()) == NULL) { REPORT_OOM; reader.ret = 1; break; }
+        if ((reader.ret = read_block(b, &eof))) { free_block(b); break; }
+        if (b->count == 0 && !eof) free_block(b);
+        else publish_block(b, eof);
+    }
+    if (!eof || reader.ret) publish_block(NULL, true);
+}
+
+static void
+read_and_score(void *unused, size_t worker) {
+    // Worker 0 reads the rest of the input and then helps with the scoring
+    if (worker == 0) read_rest();
+    run_scoring(unused, worker);
+}
+
+static void
+free_workers() {
+    free_thread_pool(pool); pool = NULL;
+    for (size_t i = 0; i < num_jobs; i++) {
+        if (jobs[i].workspace) free_workspace(jobs[i].workspace);
+        free_top(jobs + i); free(jobs[i].top); free_slabs(jobs + i);
+        free(jobs[i].match_positions);
+    }
+    free(jobs); jobs = NULL; num_jobs = 0;
+}
+
+static bool
+ensure_jobs(size_t num_threads) {
+    JobData *new_jobs;
+    if (num_threads > num_jobs) {
+        if ((new_jobs = (JobData*)realloc(jobs, num_threads * sizeof(JobData))) == NULL) return false;
+        jobs = new_jobs;
+        memset(jobs + num_jobs, 0, (num_threads - num_jobs) * sizeof(JobData));
+        for (; num_jobs < num_threads; num_jobs++) {
+            if ((jobs[num_jobs].workspace = alloc_workspace()) == NULL) return false;
+        }
+    }
+    return true;
+}
+
+static bool
+ensure_workers(size_t num_threads, bool pin) {
+    // Start the pool of workers, or a bigger one if it has fewer than num_threads
+    if (pool && thread_pool_size(pool) >= num_threads && num_jobs >= thread_pool_size(pool)) return true;
+    free_thread_pool(pool);
+    if ((pool = alloc_thread_pool(num_threads, pin)) == NULL) return false;
+    return ensure_jobs(thread_pool_size(pool));
+}
+
+static bool
+prepare_job(JobData *job) {
+    len_t *match_positions = (len_t*)realloc(job->match_positions, global.needle_len * sizeof(len_t));
+    if (match_positions == NULL) return false;
+    job->match_positions = match_positions;
+    job->scored = 0; job->chunks = 0; job->elapsed = 0; job->failed = false;
+    free_top(job); free_slabs(job);
+    return prepare_workspace(job->workspace, &global);
+}
+
+static void
+prepare_jobs(void *unused, size_t worker) {
+    // Every worker allocates its own scoring buffers, so that they are
+    // first touched, and thus placed, on the NUMA node it runs on. The same
+    // goes for the positions of the matches, see keep_positions().
+    (void)unused;
+    jobs[worker].failed = !prepare_job(jobs + worker);
+    jobs[worker].cpu = current_cpu();
+}
+
+// The number of threads is chosen from an estimate of the scoring work, one
+// thread for every work_per_thread seconds of it. The estimate is the time
+// taken to score a sample of the first candidates, per character, times the
+// size of the input. Since the sample is scored for real, it accounts for
+// the length of the query and for how many lines are rejected early.
+#define SAMPLE_SIZE 256
+#define SAMPLE_TIME 0.001
+
+static double estimated_work = -1, work_per_thread = 0;
+
+static double
+sample_cost_per_char(Block *b) {
+    // The time taken to score the first candidates of b with the first
+    // job, in this thread, per character. The results are thrown away,
+    // the candidates are scored again by the workers.
+    JobData *job = jobs;
+    Candidate *c;
+    size_t chars = 0;
+    double started_at = monotonic_time(), elapsed = 0, score;
+    for (size_t i = 0; i < b->count && i < SAMPLE_SIZE && elapsed < SAMPLE_TIME; i++) {
+        c = b->candidates + i;
+        if (!fit_workspace(job->workspace, c->haystack_len)) return -1;
+        if (c->is_ascii) score = score_item_bytes(job->workspace, c->src, c->haystack_len, job->match_positions);
+        else score = score_item(job->workspace, c->src, c->haystack_len, job->match_positions);
+        if (score < 0) return -1;
+        chars += c->haystack_len;
+        elapsed = monotonic_time() - started_at;
+    }
+    return chars ? elapsed / chars : 0;
+}
+
+static size_t
+choose_num_threads(size_t max_threads, Block *first, bool eof, double per_thread) {
+    // With the input still being read, its size is only known if it is a
+    // regular file, for pipes and compressed files, all of max_threads are used
+    size_t input_size = eof ? global.haystack_size : (reader.map ? reader.map_size : (reader.decompressor ? 0 : stdin_size()));
+    double cost_per_char;
+    if (max_threads < 2 || input_size == 0 || per_thread <= 0) return max_threads;
+    if (!ensure_jobs(1) || !prepare_job(jobs) || (cost_per_char = sample_cost_per_char(first)) < 0) return max_threads;
+    work_per_thread = per_thread;
+    estimated_work = cost_per_char * input_size;
+    return MIN(max_threads, 1 + (size_t)(estimated_work / work_per_thread));
+}
+
+static void
+print_stats(size_t num_threads, double elapsed) {
+    fprintf(stderr, "Read and scored %zu candidates with %zu threads in %.3f ms\n", input.count, num_threads, elapsed * 1000);
+    if (estimated_work >= 0) fprintf(stderr, "  estimated %.3f ms of scoring work, using a thread per %.3f ms of it\n", estimated_work * 1000, work_per_thread * 1000);
+    for (size_t i = 0; i < num_threads; i++) {
+        fprintf(stderr, "  thread %zu: %zu candidates in %zu chunks, busy scoring for %.3f ms", i, jobs[i].scored, jobs[i].chunks, jobs[i].elapsed * 1000);
+        if (jobs[i].cpu >= 0) fprintf(stderr, ", on CPU %d", jobs[i].cpu);
+        if (cpu_numa_node(jobs[i].cpu) >= 0) fprintf(stderr, " of NUMA node %d", cpu_numa_node(jobs[i].cpu));
+        fprintf(stderr, "\n");
+    }
+}
+
+static int
+run_threaded(int num_threads_asked, double per_thread, bool pin, bool stats) {
+    // Read the first block and use it to decide how many threads to use,
+    // then read the rest while the workers start scoring
+    size_t i;
+    double started_at = monotonic_time();
+    size_t num_threads = MAX(1, num_threads_asked > 0 ? num_threads_asked : cpu_count());
+    bool eof = false;
+    Block *first = alloc_block();
+    if (first == NULL) return 1;
+    if ((reader.ret = read_block(first, &eof))) { free_block(first); return reader.ret; }
+    publish_block(first, eof);
+    if (eof) num_threads = MIN(num_threads, MAX(1, (input.count + CHUNK_SIZE - 1) / CHUNK_SIZE));
+    num_threads = choose_num_threads(num_threads, first, eof, per_thread);
+
+    if (!ensure_workers(num_threads, pin)) { if (!eof) read_rest(); return 1; }
+    num_threads = thread_pool_size(pool);
+    run_in_thread_pool(pool, prepare_jobs, NULL);
+    for (i = 0; i < num_threads; i++) {
+        if (jobs[i].failed) { if (!eof) read_rest(); return 1; }
+    }
+    run_in_thread_pool(pool, eof ? run_scoring : read_and_score, NULL);
+    if (cancelled) return CANCELLED_EXIT_CODE;
+    if (reader.ret) return reader.ret;
+    for (i = 0; i < num_threads; i++) {
+        if (jobs[i].failed) return 1;
+    }
+    if (stats) print_stats(num_threads, monotonic_time() - started_at);
+    return 0;
+}
+
+static int 
+read_input(args_info *opts, char delimiter) {
+    int ret = 0;
+    Candidates results = {0};
+    Block *b;
+    Candidate **runs = NULL;
+    size_t *run_counts = NULL, num_runs;
+
+    reader.delimiter = delimiter;
+    if (opts->input_arg && (reader.map = map_file(opts->input_arg, &reader.map_size)) == NULL) return 1;
+    if (reader.map && compression_format(reader.map, reader.map_size)) {
+        // The lines are read from the decompressor, like from STDIN
+        reader.compressed = reader.map; reader.compressed_size = reader.map_size;
+        reader.map = NULL; reader.map_size = 0;
+        if ((reader.decompressor = alloc_decompressor(reader.compressed, reader.compressed_size)) == NULL) { unmap_file(reader.compressed, reader.compressed_size); return 1; }
+    }
+    if (opts->stream_flag) {
+        if (opts->limit_arg <= 0) opts->limit_arg = STREAM_LIMIT;
+        stream.opts = opts;
+        stream.interval = MAX(opts->refresh_interval_arg, 1) / 1000;
+        stream.next = monotonic_time() + stream.interval;
+    }
+    top_k = opts->limit_arg > 0 ? (size_t)opts->limit_arg : 0;
+    cancelled = 0; input.cancelled = false;
+    if ((input.monitor = alloc_monitor()) == NULL) { REPORT_OOM; return 1; }
+    // While the query is read and scored, SIGINT and SIGTERM cancel it,
+    // nothing is output and the exit code is CANCELLED_EXIT_CODE. While the
+    // results are output, they terminate the process as they normally do.
+    if (!handle_cancel_signals(cancel_query)) fprintf(stderr, "Failed to set up handling of the cancel signals\n");
+    ret = run_threaded(opts->threads_arg, opts->work_per_thread_arg / 1000, opts->pin_threads_flag, opts->stats_flag);
+    restore_cancel_signals();
+    if (ret == 0 && cancelled) ret = CANCELLED_EXIT_CODE;
+    if (ret == 0 && top_k) {
+        // The best results of each worker are already sorted, they only
+        // need to be merged
+        num_runs = thread_pool_size(pool);
+        runs = (Candidate**)malloc(num_runs * sizeof(Candidate*));
+        run_counts = (size_t*)malloc(num_runs * sizeof(size_t));
+        if (runs && run_counts) {
+            for (size_t i = 0; i < num_runs; i++) { runs[i] = jobs[i].top; run_counts[i] = jobs[i].top_count; }
+        }
+        if (runs && run_counts && output_top_results(pool, runs, run_counts, num_runs, opts, global.needle_len, delimiter)) {
+            if (opts->stream_flag) output_stream_marker(opts, delimiter);
+        } else { ret = 1; REPORT_OOM; }
+        free(runs); free(run_counts);
+    } else if (ret == 0) {
+        // Only the matches are ranked
+        ALLOC_VEC(Candidate, results, 1024);
+        if (results.data == NULL) ret = 1;
+        for (b = input.first; b && ret == 0; b = b->next) {
+            for (size_t i = 0; i < b->count; i++) {
+                if (b->candidates[i].score <= 0) continue;
+                ENSURE_SPACE(Candidate, results, 1);
+                NEXT(results) = b->candidates[i];
+                INC(results, 1);
+            }
+        }
+        if (ret == 0) output_results(pool, results.data, SIZE(results), opts, global.needle_len, delimiter);
+    } else if (ret != CANCELLED_EXIT_CODE && !reader.ret) { REPORT_OOM; }
+
+    free(reader.buf); reader.buf = NULL;
+    if (reader.map) { unmap_file(reader.map, reader.map_size); reader.map = NULL; }
+    if (reader.decompressor) {
+        free_decompressor(reader.decompressor); reader.decompressor = NULL;
+        unmap_file(reader.compressed, reader.compressed_size); reader.compressed = NULL;
+    }
+    FREE_VEC(results);
+    while (input.first) { b = input.first->next; free_block(input.first); input.first = b; }
+    input.last = NULL; input.current = NULL;
+    free_monitor(input.monitor); input.monitor = NULL;
     return ret;
 }
 
@@ -182,13 +710,13 @@ lowercase(text_t *str, len_t sz) {
     for (len_t i = 0; i < sz; i++) str[i] = LOWERCASE(str[i]);
 }
 
-#define SET_TEXT_ARG(src, name, ui_name) \
+#define SET_TEXT_ARG(src, name, ui_name, max_len) \
     arglen = strlen(src); \
-    if (arglen > LEN_MAX) { \
-        fprintf(stderr, "The %s must be no longer than %d bytes\n", ui_name, LEN_MAX); \
+    if (arglen > max_len) { \
+        fprintf(stderr, "The %s must be no longer than %d bytes\n", ui_name, max_len); \
         ret = 1; goto end; \
     } \
-    global.name##_len = (len_t)decode_string(src, arglen, global.name); \
+    global.name##_len = (len_t)decode_string(src, arglen, global.name, NULL); \
     lowercase(global.name, global.name##_len)
 
 #ifndef gengetopt_args_info_versiontext
@@ -268,16 +796,24 @@ main(int argc, char *argv[]) {
         ret = 1; 
         goto end;
     }
-    SET_TEXT_ARG(opts.inputs[0], needle, "query");
-    SET_TEXT_ARG(opts.level1_arg, level1, "level1 string");
-    SET_TEXT_ARG(opts.level2_arg, level2, "level2 string");
-    SET_TEXT_ARG(opts.level3_arg, level3, "level3 string");
+    global.needle = (text_t*)calloc(strlen(opts.inputs[0]) + 1, sizeof(text_t));
+    if (global.needle == NULL) { REPORT_OOM; ret = 1; goto end; }
+    SET_TEXT_ARG(opts.inputs[0], needle, "query", LEN_MAX);
+    SET_TEXT_ARG(opts.level1_arg, level1, "level1 string", LEVEL_MAX);
+    SET_TEXT_ARG(opts.level2_arg, level2, "level2 string", LEVEL_MAX);
+    SET_TEXT_ARG(opts.level3_arg, level3, "level3 string", LEVEL_MAX);
     if (global.needle_len < 1) { fprintf(stderr, "Empty query not allowed.\n"); ret = 1; goto end; }
+    if (strcmp(opts.format_arg, "plain") != 0 && strcmp(opts.format_arg, "jsonl") != 0) { fprintf(stderr, "Unknown output format: %s\n", opts.format_arg); ret = 1; goto end; }
+    compile_level_table(&global);
+    global.exhaustive = opts.exhaustive_flag ? true : false;
+    global.min_score = opts.min_score_arg;
     if (opts.delimiter_arg) unescape(opts.delimiter_arg, delimiter, 5);
     else delimiter[0] = '\n';
-    ret = read_stdin(&opts, delimiter[0]);
+    ret = read_input(&opts, delimiter[0]);
 
 end:
+    free_workers();
+    free(global.needle);
     cmdline_parser_free(&opts);
     return ret;
 }
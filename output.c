@@ -16,11 +16,13 @@ static inline ssize_t ms_write(int fd, const void* buf, size_t count) { return _
 #define write ms_write
 #else
 #include <unistd.h>
+#include <sys/uio.h>
 #endif
 #include <errno.h>
 
 static char mark_before[100] = {0}, mark_after[100] = {0};
 static size_t mark_before_sz = 0, mark_after_sz = 0;
+static bool jsonl = false;
 
 size_t
 unescape(char *src, char *dest, size_t destlen) {
@@ -68,103 +70,652 @@ unescape(char *src, char *dest, size_t destlen) {
 
 #define FIELD(x, which) (((Candidate*)(x))->which)
 
-static int 
+int 
 cmpscore(const void *a, const void *b) {
     double sa = FIELD(a, score), sb = FIELD(b, score);
     // Sort descending
     return (sa > sb) ? -1 : ((sa == sb) ? ((int)FIELD(a, idx) - (int)FIELD(b, idx)) : 1);
 }
 
+// Output is formatted into buffers. When writing directly, a buffer is
+// flushed to STDOUT whenever it is full, otherwise it grows to hold all that
+// is written to it, to be flushed later, see format_results_in_parallel().
+typedef struct {
+    char *data;
+    size_t size, capacity;
+    bool direct, failed;
+} OutputBuffer;
+
 #define BUF_CAPACITY 16384
 static char write_buf[BUF_CAPACITY] = {0};
-static size_t write_buf_sz = 0;
 
 static void
-eintr_write() {
+eintr_write(const char *buf, size_t sz) {
     ssize_t ret;
-    char *buf = write_buf;
-    while (write_buf_sz > 0) {
+    while (sz > 0) {
         errno = 0;
-        ret = write(STDOUT_FILENO, buf, write_buf_sz);
+        ret = write(STDOUT_FILENO, buf, sz);
         if (ret <= 0) {
             if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) continue;
             perror("Could not write to output"); exit(1); 
         }
         buf += ret;
-        write_buf_sz -= ret;
+        sz -= ret;
     }
 }
 
+static inline void
+flush_write_buf(OutputBuffer *ob) {
+    eintr_write(ob->data, ob->size);
+    ob->size = 0;
+}
+
 
 static void
-buffered_write(const char *buf, size_t sz) {
-    if (sz + write_buf_sz < BUF_CAPACITY) {
-        memcpy(write_buf + write_buf_sz, buf, sz);
-        write_buf_sz += sz;
+buffered_write(OutputBuffer *ob, const char *buf, size_t sz) {
+    char *data;
+    if (sz + ob->size < ob->capacity) {
+        memcpy(ob->data + ob->size, buf, sz);
+        ob->size += sz;
+    } else if (ob->direct) {
+        flush_write_buf(ob);
+        if (sz >= ob->capacity) eintr_write(buf, sz);
+        else buffered_write(ob, buf, sz);
     } else {
-        eintr_write();
-        if (sz > BUF_CAPACITY) { fprintf(stderr, "Cannot write in large chunk sizes\n"); exit(1); }
-        buffered_write(buf, sz);
+        if (ob->failed) return;
+        size_t capacity = MAX(2 * ob->capacity, ob->size + sz + BUF_CAPACITY);
+        if ((data = (char*)realloc(ob->data, capacity)) == NULL) { ob->failed = true; return; }
+        ob->data = data; ob->capacity = capacity;
+        buffered_write(ob, buf, sz);
     }
 }
 
 static void
-write_text(text_t *text, size_t sz) {
-    static char buf[10] = {0};
+write_text(OutputBuffer *ob, text_t *text, size_t sz) {
+    char buf[10] = {0};
     for (size_t i = 0; i < sz; i++) {
         unsigned int num = encode_codepoint(text[i], buf);
-        if (num > 0) buffered_write(buf, num);
+        if (num > 0) buffered_write(ob, buf, num);
+    }
+}
+
+// Lines are output from their raw bytes whenever possible, only lines that
+// were not valid UTF-8 are encoded again from their decoded characters. For
+// lines that are not pure ASCII, the byte offsets of characters are found by
+// moving a cursor forward over the raw bytes, as the spans to output always
+// come in order.
+typedef struct {
+    Candidate *c;
+    size_t ch, byte;  // A character index and the offset of its first byte
+} Cursor;
+
+static inline size_t
+byte_offset(Cursor *cur, size_t ch) {
+    const uint8_t *raw = (const uint8_t*)cur->c->raw;
+    for (; cur->ch < ch; cur->ch++) {
+        for (cur->byte++; cur->byte < cur->c->raw_sz && (raw[cur->byte] & 0xc0) == 0x80; cur->byte++);
     }
+    return cur->byte;
+}
+
+static inline void
+write_chars(OutputBuffer *ob, Cursor *cur, size_t start, size_t count) {
+    Candidate *c = cur->c;
+    size_t first;
+    if (c->is_ascii) buffered_write(ob, (char*)c->src + start, count);
+    else if (c->raw) {
+        first = byte_offset(cur, start);
+        buffered_write(ob, c->raw + first, byte_offset(cur, start + count) - first);
+    }
+    else write_text(ob, (text_t*)c->src + start, count);
 }
 
 static void
-output_with_marks(text_t *src, size_t src_sz, len_t *positions, len_t poslen) {
-    size_t pos, i = 0;
+output_with_marks(OutputBuffer *ob, Candidate *c, len_t poslen) {
+    size_t pos, i = 0, src_sz = c->src_sz;
+    Cursor cur = {c, 0, 0};
     for (pos = 0; pos < poslen; pos++, i++) {
-        write_text(src + i, MIN(src_sz, positions[pos]) - i);
-        i = positions[pos];
+        write_chars(ob, &cur, i, MIN(src_sz, CANDIDATE_POSITION(c, pos)) - i);
+        i = CANDIDATE_POSITION(c, pos);
         if (i < src_sz) {
-            if (mark_before_sz > 0) buffered_write(mark_before, mark_before_sz);
-            write_text(src + i, 1);
-            if (mark_after_sz > 0) buffered_write(mark_after, mark_after_sz);
+            if (mark_before_sz > 0) buffered_write(ob, mark_before, mark_before_sz);
+            write_chars(ob, &cur, i, 1);
+            if (mark_after_sz > 0) buffered_write(ob, mark_after, mark_after_sz);
         }
     }
-    i = positions[poslen - 1];
-    if (i + 1 < src_sz) write_text(src + i + 1, src_sz - i - 1);
+    i = CANDIDATE_POSITION(c, poslen - 1);
+    if (i + 1 < src_sz) write_chars(ob, &cur, i + 1, src_sz - i - 1);
+}
+
+// Numbers are formatted into a local buffer, which must have room for at
+// least MAX_NUMBER_SIZE more bytes, and written out together
+#define MAX_NUMBER_SIZE 64
+
+static inline char*
+format_uint(char *p, uint64_t n) {
+    // Returns the end of the formatted number
+    char *end;
+    uint64_t m = n;
+    for (end = p + 1; m >= 10; m /= 10) end++;
+    p = end;
+    do { *--p = (char)('0' + n % 10); n /= 10; } while (n);
+    return end;
 }
 
 static void
-output_positions(len_t *positions, len_t num) {
-    static char pbuf[100] = {0};
+output_positions(OutputBuffer *ob, Candidate *c, len_t num) {
+    char buf[1024], *p = buf;
     for (len_t i = 0; i < num; i++) {
-        buffered_write(pbuf, snprintf(pbuf, sizeof(pbuf), "%u%s", positions[i], (i == num - 1) ? ":" : ","));
+        if ((size_t)(p - buf) + MAX_NUMBER_SIZE > sizeof(buf)) { buffered_write(ob, buf, p - buf); p = buf; }
+        p = format_uint(p, CANDIDATE_POSITION(c, i));
+        *p++ = (i == num - 1) ? ':' : ',';
+    }
+    buffered_write(ob, buf, p - buf);
+}
+
+// The JSON lines output is formatted by hand, as calling snprintf() for
+// every field would take longer than everything else. Strings only need
+// escaping for the quote, the backslash and the control characters, the
+// text is output as UTF-8.
+static const char hex_digits[] = "0123456789abcdef";
+
+static void
+write_json_string(OutputBuffer *ob, const char *s, size_t sz) {
+    size_t start = 0, i;
+    unsigned char ch;
+    char escape[6] = {'\\', 'u', '0', '0', 0, 0};
+    for (i = 0; i < sz; i++) {
+        ch = (unsigned char)s[i];
+        if (ch >= 0x20 && ch != '"' && ch != '\\') continue;
+        if (i > start) buffered_write(ob, s + start, i - start);
+        start = i + 1;
+        switch (ch) {
+            case '"': buffered_write(ob, "\\\"", 2); break;
+            case '\\': buffered_write(ob, "\\\\", 2); break;
+            case '\n': buffered_write(ob, "\\n", 2); break;
+            case '\r': buffered_write(ob, "\\r", 2); break;
+            case '\t': buffered_write(ob, "\\t", 2); break;
+            default:
+                escape[4] = hex_digits[ch >> 4]; escape[5] = hex_digits[ch & 0xf];
+                buffered_write(ob, escape, sizeof(escape));
+        }
+    }
+    if (i > start) buffered_write(ob, s + start, i - start);
+}
+
+static void
+write_json_text(OutputBuffer *ob, text_t *text, size_t sz) {
+    // Encode the characters into chunks, to escape them
+    char buf[256];
+    size_t n = 0;
+    for (size_t i = 0; i < sz; i++) {
+        if (n + 4 > sizeof(buf)) { write_json_string(ob, buf, n); n = 0; }
+        n += encode_codepoint(text[i], buf + n);
+    }
+    write_json_string(ob, buf, n);
+}
+
+// Scores are output in the shortest form that reads back as exactly the
+// same double, so that scores that differ are never output as equal, while
+// 0.1 is still output as 0.1. Scores from about 1e-4 to 1e16 are converted
+// with exact 128 bit integer arithmetic, see shortest_digits(), other doubles
+// with the free-format algorithm of Burger and Dybvig, which needs exact
+// arithmetic on numbers of up to about 1100 bits, done with these minimal
+// bignums.
+#define BIG_WORDS 40
+
+static const uint64_t powers_of_ten[20] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000, 10000000000, 100000000000,
+    1000000000000, 10000000000000, 100000000000000, 1000000000000000, 10000000000000000,
+    100000000000000000, 1000000000000000000, 10000000000000000000u};
+
+typedef struct {
+    uint32_t w[BIG_WORDS];  // Least significant word first
+    size_t n;  // The number of words in use, the top one is never 0
+} BigNum;
+
+static inline void
+big_set(BigNum *a, uint64_t v) {
+    for (a->n = 0; v; v >>= 32) a->w[a->n++] = (uint32_t)v;
+}
+
+static void
+big_shift(BigNum *a, unsigned bits) {
+    // Multiply a by 2**bits
+    size_t words = bits / 32, i;
+    uint32_t carry = 0, v;
+    if (a->n == 0) return;
+    if ((bits %= 32)) {
+        for (i = 0; i < a->n; i++) { v = a->w[i]; a->w[i] = (v << bits) | carry; carry = v >> (32 - bits); }
+        if (carry) a->w[a->n++] = carry;
     }
+    if (words) {
+        memmove(a->w + words, a->w, a->n * sizeof(uint32_t));
+        memset(a->w, 0, words * sizeof(uint32_t));
+        a->n += words;
+    }
+}
+
+static void
+big_mul(BigNum *a, uint32_t m) {
+    uint64_t carry = 0;
+    for (size_t i = 0; i < a->n; i++) { carry += (uint64_t)a->w[i] * m; a->w[i] = (uint32_t)carry; carry >>= 32; }
+    if (carry) a->w[a->n++] = (uint32_t)carry;
 }
 
+static void
+big_mul_pow10(BigNum *a, unsigned k) {
+    for (; k >= 9; k -= 9) big_mul(a, 1000000000u);
+    if (k) big_mul(a, (uint32_t)powers_of_ten[k]);
+}
+
+static int
+big_cmp(const BigNum *a, const BigNum *b) {
+    if (a->n != b->n) return a->n < b->n ? -1 : 1;
+    for (size_t i = a->n; i-- > 0;) {
+        if (a->w[i] != b->w[i]) return a->w[i] < b->w[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+static int
+big_cmp_sum(const BigNum *a, const BigNum *b, const BigNum *c) {
+    // Compare a + b with c
+    BigNum sum;
+    uint64_t carry = 0;
+    size_t i, n = MAX(a->n, b->n);
+    for (i = 0; i < n; i++) {
+        carry += (uint64_t)(i < a->n ? a->w[i] : 0) + (i < b->n ? b->w[i] : 0);
+        sum.w[i] = (uint32_t)carry; carry >>= 32;
+    }
+    if (carry) sum.w[i++] = (uint32_t)carry;
+    sum.n = i;
+    return big_cmp(&sum, c);
+}
 
 static void
-output_result(Candidate *c, args_info *opts, len_t needle_len, char delim) {
+big_sub(BigNum *a, const BigNum *b) {
+    // Subtract b from a, which must not be smaller
+    int64_t borrow = 0;
+    for (size_t i = 0; i < a->n; i++) {
+        borrow += (int64_t)a->w[i] - (i < b->n ? b->w[i] : 0);
+        a->w[i] = (uint32_t)borrow; borrow = borrow < 0 ? -1 : 0;
+    }
+    while (a->n && a->w[a->n - 1] == 0) a->n--;
+}
+
+static inline uint64_t
+mul_64(uint64_t a, uint64_t b, uint64_t *high) {
+    // Returns the low word of the 128 bit product of a and b
+    uint64_t a0 = (uint32_t)a, a1 = a >> 32, b0 = (uint32_t)b, b1 = b >> 32;
+    uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0;
+    uint64_t mid = (p00 >> 32) + (uint32_t)p01 + (uint32_t)p10;
+    *high = a1 * b1 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+    return (mid << 32) | (uint32_t)p00;
+}
+
+static inline uint64_t
+scale(uint64_t m, uint64_t hi, uint64_t lo, unsigned shift, bool *exact) {
+    // Returns m * (hi * 2**64 + lo) / 2**shift, rounded down, where the
+    // product fits in 128 bits and the result in 64 bits
+    uint64_t high, low = mul_64(m, lo, &high);
+    high += m * hi;
+    if (shift == 0) { *exact = true; return low; }
+    if (shift < 64) { *exact = (low << (64 - shift)) == 0; return (low >> shift) | (high << (64 - shift)); }
+    *exact = low == 0 && (shift == 64 || (high << (128 - shift)) == 0);
+    return high >> (shift - 64);
+}
+
+static int
+shortest_digits(double x, char *digits, size_t *num_digits) {
+    // Writes the shortest digits that read back as x, which must be positive
+    // and finite, and returns the decimal exponent of the first digit
+    uint64_t bits, f;
+    int e, k, low, high;
+    unsigned bitlen;
+    bool unequal_gaps, even;
+    double estimate;
+    BigNum r, s, m_plus, m_minus;
+    memcpy(&bits, &x, sizeof(bits));
+    f = bits & ((UINT64_C(1) << 52) - 1);
+    e = (int)((bits >> 52) & 0x7ff);
+    if (e) { f |= UINT64_C(1) << 52; e -= 1075; } else e = -1074;
+    // x is f * 2**e. The gap to the double below it is half the gap to the
+    // one above for powers of two. Halfway between x and its neighbours reads
+    // back as x when f is even, as reading rounds to even.
+    unequal_gaps = f == (UINT64_C(1) << 52) && e > -1074;
+    even = (f & 1) == 0;
+    // k is the number of digits before the decimal point. The estimate is
+    // never too big, and at most one too small.
+    for (bitlen = 0; (f >> bitlen) > 1; bitlen++);
+    estimate = (e + (int)bitlen) * 0.30102999566398114 - 1e-10;
+    k = (int)estimate;
+    if (estimate > 0 && estimate > k) k++;
+    if (k >= -3 && e <= 2) {
+        // x, and the points halfway to its neighbours, times 10**q, have 18
+        // or 19 digits before the decimal point, small enough to be computed
+        // exactly. Digits are removed from them for as long as they differ,
+        // as in Ryu by Ulf Adams.
+        int q = 18 - k;
+        uint64_t hi = 0, lo = powers_of_ten[MIN(q, 19)], vr, vp, vm, out;
+        bool vr_exact, vp_exact, vm_exact;
+        unsigned removed = 0, last = 0;
+        if (q > 19) lo = mul_64(lo, powers_of_ten[q - 19], &hi);
+        vr = scale(4 * f, hi, lo, 2 - e, &vr_exact);
+        vp = scale(4 * f + 2, hi, lo, 2 - e, &vp_exact);
+        vm = scale(4 * f - 2 + unequal_gaps, hi, lo, 2 - e, &vm_exact);
+        vm_exact = vm_exact && even;
+        if (vp_exact && !even) vp--;
+        while (vp / 10 > vm / 10) {
+            vm_exact = vm_exact && vm % 10 == 0;
+            vr_exact = vr_exact && last == 0;
+            last = vr % 10; vr /= 10; vp /= 10; vm /= 10; removed++;
+        }
+        while (vm_exact && vm % 10 == 0) {
+            vr_exact = vr_exact && last == 0;
+            last = vr % 10; vr /= 10; vm /= 10; removed++;
+        }
+        if (vr_exact && last == 5 && vr % 2 == 0) last = 4;  // round to even
+        out = vr + ((vr == vm && !vm_exact) || last >= 5);
+        while (out % 10 == 0) { out /= 10; removed++; }
+        *num_digits = format_uint(digits, out) - digits;
+        return (int)(*num_digits + removed) - 1 - q;
+    }
+    // Otherwise r / s is x and the points halfway to its neighbours are
+    // m_minus / s below it and m_plus / s above it, scaled by 10**k
+    big_set(&r, f); big_set(&s, 1); big_set(&m_plus, 1); big_set(&m_minus, 1);
+    if (e >= 0) {
+        big_shift(&r, e + 1 + unequal_gaps); big_shift(&s, 1 + unequal_gaps);
+        big_shift(&m_plus, e + unequal_gaps); big_shift(&m_minus, e);
+    } else {
+        big_shift(&r, 1 + unequal_gaps); big_shift(&s, 1 - e + unequal_gaps); big_shift(&m_plus, unequal_gaps);
+    }
+    if (k >= 0) big_mul_pow10(&s, k);
+    else { big_mul_pow10(&r, -k); big_mul_pow10(&m_plus, -k); big_mul_pow10(&m_minus, -k); }
+    if (big_cmp_sum(&r, &m_plus, &s) >= (even ? 0 : 1)) { big_mul(&s, 10); k++; }
+    // Generate digits until the rest lies within the gap to a neighbour
+    *num_digits = 0;
+    do {
+        int digit = 0;
+        big_mul(&r, 10); big_mul(&m_plus, 10); big_mul(&m_minus, 10);
+        while (big_cmp(&r, &s) >= 0) { big_sub(&r, &s); digit++; }
+        low = big_cmp(&r, &m_minus) < (even ? 1 : 0);
+        high = big_cmp_sum(&r, &m_plus, &s) > (even ? -1 : 0);
+        if (low && high) {
+            // Round to the nearest of the two, to even for a tie
+            int half;
+            big_shift(&r, 1);
+            half = big_cmp(&r, &s);
+            if (half > 0 || (half == 0 && digit % 2)) digit++;
+        } else if (high) digit++;
+        digits[(*num_digits)++] = (char)('0' + digit);
+    } while (!low && !high);
+    return k - 1;
+}
+
+static char*
+format_score(char *p, double score) {
+    // Returns the end of the formatted score. Scores are formatted like %g,
+    // in scientific notation only when very small or very large.
+    char digits[24];
+    size_t n, i;
+    int exponent;
+    if (!(score > 0)) { *p++ = '0'; return p; }
+    exponent = shortest_digits(score, digits, &n);
+    if (exponent < -4 || exponent >= 17) {
+        *p++ = digits[0];
+        if (n > 1) { *p++ = '.'; memcpy(p, digits + 1, n - 1); p += n - 1; }
+        *p++ = 'e'; *p++ = exponent < 0 ? '-' : '+';
+        if (exponent < 0) exponent = -exponent;
+        if (exponent < 10) *p++ = '0';
+        return format_uint(p, exponent);
+    }
+    if (exponent < 0) {
+        *p++ = '0'; *p++ = '.';
+        for (i = 1; i < (size_t)-exponent; i++) *p++ = '0';
+        memcpy(p, digits, n);
+        return p + n;
+    }
+    for (i = 0; i < n || i <= (size_t)exponent; i++) {
+        if (i == (size_t)exponent + 1) *p++ = '.';
+        *p++ = i < n ? digits[i] : '0';
+    }
+    return p;
+}
+
+static void
+output_json_result(OutputBuffer *ob, Candidate *c, len_t needle_len) {
+    buffered_write(ob, "{\"line\":\"", 9);
+    if (c->is_ascii) write_json_string(ob, (char*)c->src, c->src_sz);
+    else if (c->raw) write_json_string(ob, c->raw, c->raw_sz);
+    else write_json_text(ob, (text_t*)c->src, c->src_sz);
+    char buf[1024], *p = buf;
+#define APPEND(x) memcpy(p, x, sizeof(x) - 1); p += sizeof(x) - 1
+    APPEND("\",\"index\":");
+    p = format_uint(p, c->idx);
+    APPEND(",\"score\":");
+    p = format_score(p, c->score);
+    APPEND(",\"positions\":[");
+    for (len_t i = 0; i < needle_len; i++) {
+        if ((size_t)(p - buf) + MAX_NUMBER_SIZE > sizeof(buf)) { buffered_write(ob, buf, p - buf); p = buf; }
+        if (i) *p++ = ',';
+        p = format_uint(p, CANDIDATE_POSITION(c, i));
+    }
+    APPEND("]}\n");
+#undef APPEND
+    buffered_write(ob, buf, p - buf);
+}
+
+static void
+output_result(OutputBuffer *ob, Candidate *c, args_info *opts, len_t needle_len, char delim) {
     UNUSED(opts);
-    if (opts->positions_flag) output_positions(c->positions, needle_len);
+    if (jsonl) { output_json_result(ob, c, needle_len); return; }
+    if (opts->positions_flag) output_positions(ob, c, needle_len);
     if (mark_before_sz > 0 || mark_after_sz > 0) {
-        output_with_marks(c->src, c->src_sz, c->positions, needle_len);
+        output_with_marks(ob, c, needle_len);
+    } else if (c->is_ascii) {
+        buffered_write(ob, (char*)c->src, c->src_sz);
+    } else if (c->raw) {
+        buffered_write(ob, c->raw, c->raw_sz);
     } else {
-        write_text(c->src, c->src_sz);
+        write_text(ob, (text_t*)c->src, c->src_sz);
     }
-    buffered_write(&delim, 1);
+    buffered_write(ob, &delim, 1);
 }
 
 
-void
-output_results(Candidate *haystack, size_t count, args_info *opts, len_t needle_len, char delim) {
-    Candidate *c;
-    qsort(haystack, count, sizeof(*haystack), cmpscore);
-    size_t left = opts->limit_arg > 0 ? (size_t)opts->limit_arg : count;
+// Results are sorted in parallel once there are this many of them: each
+// worker of the pool sorts a slice, then the slices are merged
+#define MIN_PARALLEL_SORT 8192
+
+typedef struct {
+    Candidate *items;
+    size_t count, num_slices;
+} SortJob;
+
+#define SLICE_START(job, i) ((job)->count * (i) / (job)->num_slices)
+
+static void
+sort_slice(void *j, size_t worker) {
+    SortJob *job = (SortJob*)j;
+    size_t start = SLICE_START(job, worker), end = SLICE_START(job, worker + 1);
+    qsort(job->items + start, end - start, sizeof(Candidate), cmpscore);
+}
+
+static inline void
+sift_down(Candidate **runs, size_t *heap, size_t n, size_t i) {
+    // Move heap[i] down until the first candidate of its run comes before
+    // those of the runs below it
+    size_t child, s = heap[i];
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && cmpscore(runs[heap[child + 1]], runs[heap[child]]) < 0) child++;
+        if (cmpscore(runs[s], runs[heap[child]]) <= 0) break;
+        heap[i] = heap[child]; i = child;
+    }
+    heap[i] = s;
+}
+
+static void
+merge_runs(Candidate **runs, size_t *run_counts, size_t num_runs, Candidate *merged, size_t count, size_t *heap) {
+    // Merge the first count candidates of the sorted runs into merged,
+    // advancing runs and run_counts past them. heap, with room for num_runs
+    // entries, keeps the runs that are not empty ordered by their first
+    // candidate, so that each candidate takes O(log(num_runs)) comparisons.
+    size_t i, s, n = 0;
+    for (s = 0; s < num_runs; s++) { if (run_counts[s] > 0) heap[n++] = s; }
+    for (i = n / 2; i-- > 0;) sift_down(runs, heap, n, i);
+    for (i = 0; i < count && n > 0; i++) {
+        s = heap[0];
+        merged[i] = *(runs[s]++);
+        if (--run_counts[s] == 0) heap[0] = heap[--n];
+        sift_down(runs, heap, n, 0);
+    }
+}
+
+static Candidate*
+sort_results(void *pool, Candidate *items, size_t count) {
+    // Returns the sorted results, either in place or in a newly allocated array
+    SortJob job = {items, count, pool ? thread_pool_size(pool) : 1};
+    Candidate *merged = NULL, **runs = NULL;
+    size_t *run_counts = NULL, *heap = NULL, s;
+    if (job.num_slices > 1 && count >= MIN_PARALLEL_SORT) {
+        merged = (Candidate*)malloc(count * sizeof(Candidate));
+        runs = (Candidate**)malloc(job.num_slices * sizeof(Candidate*));
+        run_counts = (size_t*)malloc(job.num_slices * sizeof(size_t));
+        heap = (size_t*)malloc(job.num_slices * sizeof(size_t));
+    }
+    if (merged == NULL || runs == NULL || run_counts == NULL || heap == NULL) {
+        free(merged); free(runs); free(run_counts); free(heap);
+        qsort(items, count, sizeof(Candidate), cmpscore);
+        return items;
+    }
+    run_in_thread_pool(pool, sort_slice, &job);
+    for (s = 0; s < job.num_slices; s++) {
+        runs[s] = items + SLICE_START(&job, s);
+        run_counts[s] = SLICE_START(&job, s + 1) - SLICE_START(&job, s);
+    }
+    merge_runs(runs, run_counts, job.num_slices, merged, count, heap);
+    free(runs); free(run_counts); free(heap);
+    return merged;
+}
+
+// Results are formatted in parallel once there are this many of them. The
+// results are formatted in rounds, in each of which every worker of the pool
+// formats the next FORMAT_ROUND_SIZE results into its own buffer, then the
+// buffers are written out in order, which bounds the memory used.
+#define MIN_PARALLEL_FORMAT 4096
+#define FORMAT_ROUND_SIZE 4096
+
+typedef struct {
+    Candidate *results;
+    size_t count, num_slices;
+    OutputBuffer *buffers;
+    args_info *opts;
+    len_t needle_len;
+    char delim;
+} FormatJob;
+
+static void
+format_slice(void *j, size_t worker) {
+    FormatJob *job = (FormatJob*)j;
+    OutputBuffer *ob = job->buffers + worker;
+    size_t start = SLICE_START(job, worker), end = SLICE_START(job, worker + 1);
+    ob->size = 0; ob->failed = false;
+    for (size_t i = start; i < end; i++) output_result(ob, job->results + i, job->opts, job->needle_len, job->delim);
+}
+
+static void
+write_buffers(OutputBuffer *buffers, size_t count) {
+    // Write the buffers to STDOUT, in order, with as few calls as possible
+#ifdef ISWINDOWS
+    for (size_t i = 0; i < count; i++) eintr_write(buffers[i].data, buffers[i].size);
+#else
+    struct iovec iov[64];
+    size_t i = 0, n, done;
+    ssize_t ret;
+    while (i < count) {
+        for (n = 0; n < sizeof(iov) / sizeof(iov[0]) && i + n < count; n++) { iov[n].iov_base = buffers[i + n].data; iov[n].iov_len = buffers[i + n].size; }
+        errno = 0;
+        ret = writev(STDOUT_FILENO, iov, (int)n);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) continue;
+            perror("Could not write to output"); exit(1);
+        }
+        // Skip the buffers that were written in full, and write the
+        // remainder of a partially written one without writev
+        for (done = (size_t)ret; i < count && done >= buffers[i].size; i++) done -= buffers[i].size;
+        if (done > 0) { eintr_write(buffers[i].data + done, buffers[i].size - done); i++; }
+    }
+#endif
+}
+
+static bool
+format_results_in_parallel(void *pool, Candidate *results, size_t count, args_info *opts, len_t needle_len, char delim) {
+    FormatJob job = {results, 0, thread_pool_size(pool), NULL, opts, needle_len, delim};
+    OutputBuffer *buffers = (OutputBuffer*)calloc(job.num_slices, sizeof(OutputBuffer));
+    OutputBuffer direct = {write_buf, 0, BUF_CAPACITY, true, false};
+    size_t s, round;
+    if (buffers == NULL) return false;
+    job.buffers = buffers;
+    for (size_t done = 0; done < count; done += round) {
+        round = MIN(count - done, job.num_slices * FORMAT_ROUND_SIZE);
+        job.results = results + done; job.count = round;
+        run_in_thread_pool(pool, format_slice, &job);
+        for (s = 0; s < job.num_slices && !buffers[s].failed; s++);
+        if (s < job.num_slices) {
+            // Out of memory, format this round in this thread
+            for (s = 0; s < round; s++) output_result(&direct, job.results + s, opts, needle_len, delim);
+            flush_write_buf(&direct);
+        } else write_buffers(buffers, job.num_slices);
+    }
+    for (s = 0; s < job.num_slices; s++) free(buffers[s].data);
+    free(buffers);
+    return true;
+}
+
+static void
+output_sorted(void *pool, Candidate *results, size_t count, args_info *opts, len_t needle_len, char delim) {
+    OutputBuffer ob = {write_buf, 0, BUF_CAPACITY, true, false};
     if (opts->mark_before_arg) mark_before_sz = unescape(opts->mark_before_arg, mark_before, sizeof(mark_before) - 1);
     if (opts->mark_after_arg) mark_after_sz = unescape(opts->mark_after_arg, mark_after, sizeof(mark_before) - 1);
-    for (size_t i = 0; i < left; i++) {
-        c = haystack + i;
-        if (c->score > 0) output_result(c, opts, needle_len, delim);
-    }
-    if (write_buf_sz > 0) eintr_write();
+    jsonl = strcmp(opts->format_arg, "jsonl") == 0;
+    if (pool && thread_pool_size(pool) > 1 && count >= MIN_PARALLEL_FORMAT && format_results_in_parallel(pool, results, count, opts, needle_len, delim)) return;
+    for (size_t i = 0; i < count; i++) output_result(&ob, results + i, opts, needle_len, delim);
+    if (ob.size > 0) flush_write_buf(&ob);
+}
+
+void
+output_results(void *pool, Candidate *haystack, size_t count, args_info *opts, len_t needle_len, char delim) {
+    // haystack holds only the candidates that matched
+    Candidate *results = sort_results(pool, haystack, count);
+    size_t left = opts->limit_arg > 0 ? MIN((size_t)opts->limit_arg, count) : count;
+    output_sorted(pool, results, left, opts, needle_len, delim);
+    if (results != haystack) free(results);
+}
+
+bool
+output_top_results(void *pool, Candidate **runs, size_t *run_counts, size_t num_runs, args_info *opts, len_t needle_len, char delim) {
+    // Output the best --limit of the results, from runs that are each sorted.
+    // Returns false, having output nothing, if out of memory.
+    size_t count = 0, s;
+    Candidate *results;
+    size_t *heap;
+    for (s = 0; s < num_runs; s++) count += run_counts[s];
+    count = MIN((size_t)opts->limit_arg, count);
+    results = (Candidate*)malloc((count + 1) * sizeof(Candidate));
+    heap = (size_t*)malloc((num_runs + 1) * sizeof(size_t));
+    if (results == NULL || heap == NULL) { free(results); free(heap); return false; }
+    merge_runs(runs, run_counts, num_runs, results, count, heap);
+    output_sorted(pool, results, count, opts, needle_len, delim);
+    free(results); free(heap);
+    return true;
+}
+
+void
+output_stream_marker(args_info *opts, char delim) {
+    // Ends the results of a refresh with --stream
+    char marker[100];
+    size_t sz = opts->stream_marker_arg ? unescape(opts->stream_marker_arg, marker, sizeof(marker) - 1) : 0;
+    marker[sz++] = jsonl ? '\n' : delim;
+    eintr_write(marker, sz);
 }
@@ -10,173 +10,721 @@
 #include <string.h>
 #include <float.h>
 #include <stdio.h>
+#include "simd.h"
+
+// The number of characters compared at once when building position masks
+#if defined(__AVX2__)
+#define CHAR_LANES 8
+#define BYTE_LANES 32
+#elif defined(USE_SSE2)
+#define CHAR_LANES 4
+#define BYTE_LANES 16
+#else
+#define CHAR_LANES 8
+#define BYTE_LANES 8
+#endif
+
+typedef struct {
+    double score;  // The best score of the alignments that end, or start, at pos
+    len_t pos;
+    len_t until;  // The index of the first query this entry is no longer the best for
+} Envelope;
 
 typedef struct {
-    len_t *positions_buf;  // buffer to store positions for every char in needle
-    len_t **positions;  // Array of pointers into positions_buf
+    len_t *positions_buf;  // buffer to store positions for every distinct char in needle, one after the other
+    len_t **positions;  // Array of pointers into positions_buf, needle chars that are the same share a list
     len_t *positions_count; // Array of counts for positions
+    text_t *distinct;  // The distinct chars in needle
+    len_t *distinct_of;  // distinct_of[i] is the index of needle[i] in distinct
+    len_t distinct_count;  // The number of distinct chars in needle
+    uint64_t *masks;  // masks[d * mask_words + k] has bit b set if haystack[64 * k + b] is distinct[d]
+    len_t *ranks;  // ranks[d * mask_words + k] is the number of bits set in masks[d * mask_words + 0..k-1]
+    len_t mask_words;  // The number of words in the mask of one char
+    len_t *occurrences;  // The number of positions of each distinct char
+    len_t *offsets;  // offsets[d] is the index of the first position of distinct[d] in positions_buf
     len_t needle_len;  // Length of the needle
-    len_t max_haystack_len;  // Max length of a string in the haystack
+    len_t needle_capacity;  // Max length of a needle the buffers can hold
+    len_t max_haystack_len;  // Max length of a string in the haystack the buffers can hold
     len_t haystack_len; // Length of the current string in the haystack
     len_t *address; // Array of offsets into the positions array
     double max_score_per_char;
-    uint8_t *level_factors;  // Array of score factors for every character in the current haystack that matches a character in the needle
-    text_t *level1, *level2, *level3;  // The characters in the levels
-    len_t level1_len, level2_len, level3_len;
+    uint8_t *level_factors;  // Array of score factors for every character in the current haystack that matches a character in the needle, other entries are stale
+    LevelTable *level_table;  // The level factors of all special characters
     text_t *needle;  // The current needle
-    text_t *haystack; //The current haystack
+    double *best;  // best[rows[i] + j] is first the highest score of needle[0..i] in an alignment with needle[i] at positions[i][j], then that of needle[i+1..]
+    size_t *rows;  // rows[i] is the index in best of the row of needle[i]
+    size_t best_capacity;  // The number of entries best can hold
+    double *prefix_scores;  // The scores of the prefixes of the current address
+    double *suffix_bounds;  // Upper bounds on the scores of the suffixes of the needle
+    double *row_best;  // Running maxima over one row of best, see process_item_dp()
+    Envelope *envelope;  // The upper envelope of the distance scores of one row of best, see envelope_add()
+    len_t row_capacity;  // The number of entries row_best and envelope can hold
+    double min_score;  // Candidates scoring less than this are discarded
+    double max_char_factor;  // The highest score of a single char, as a multiple of max_score_per_char
+    bool exhaustive;  // Enumerate all alignments instead of using dynamic programming
 } WorkSpace;
 
+#define NUKE(x) free(x); x = NULL;
+
+static void
+free_buffers(WorkSpace *w) {
+    NUKE(w->positions_buf);
+    NUKE(w->positions);
+    NUKE(w->positions_count);
+    NUKE(w->distinct);
+    NUKE(w->distinct_of);
+    NUKE(w->masks);
+    NUKE(w->ranks);
+    NUKE(w->occurrences);
+    NUKE(w->offsets);
+    NUKE(w->level_factors);
+    NUKE(w->best);
+    NUKE(w->rows);
+    NUKE(w->prefix_scores);
+    NUKE(w->suffix_bounds);
+    NUKE(w->row_best);
+    NUKE(w->envelope);
+    w->best_capacity = 0; w->row_capacity = 0;
+}
+
+static bool
+resize_workspace(WorkSpace *w, len_t needle_len, len_t max_haystack_len) {
+    // Make sure the buffers fit a needle and a haystack of the specified
+    // lengths. Nothing in them outlives the scoring of one haystack, so they
+    // are simply reallocated when either length outgrows them. The needle is
+    // lowercased, so its distinct chars occur at different positions and
+    // positions_buf needs room for one haystack. The buffers of the dynamic
+    // programming pass depend on the number of positions, see fit_rows().
+    if (needle_len <= w->needle_capacity && max_haystack_len <= w->max_haystack_len) return true;
+    needle_len = MAX(needle_len, w->needle_capacity);
+    max_haystack_len = MAX(max_haystack_len, w->max_haystack_len);
+    free_buffers(w);
+    w->needle_capacity = 0; w->max_haystack_len = 0;
+    w->mask_words = max_haystack_len / 64 + 1;
+    w->positions_buf = (len_t*) calloc(max_haystack_len, sizeof(len_t));
+    w->positions = (len_t**)calloc(needle_len, sizeof(len_t*));
+    w->positions_count = (len_t*)calloc(2*needle_len, sizeof(len_t));
+    w->distinct = (text_t*)calloc(needle_len, sizeof(text_t));
+    w->distinct_of = (len_t*)calloc(needle_len, sizeof(len_t));
+    w->masks = (uint64_t*)calloc(needle_len, sizeof(uint64_t) * w->mask_words);
+    w->ranks = (len_t*)calloc(needle_len, sizeof(len_t) * w->mask_words);
+    w->occurrences = (len_t*)calloc(needle_len, sizeof(len_t));
+    w->offsets = (len_t*)calloc(needle_len, sizeof(len_t));
+    w->level_factors = (uint8_t*)calloc(max_haystack_len, sizeof(uint8_t));
+    w->rows = (size_t*)calloc(needle_len, sizeof(size_t));
+    w->prefix_scores = (double*)calloc(needle_len, sizeof(double));
+    w->suffix_bounds = (double*)calloc(needle_len, sizeof(double));
+    if (w->positions == NULL || w->positions_buf == NULL || w->positions_count == NULL || w->distinct == NULL || w->distinct_of == NULL || w->masks == NULL || w->ranks == NULL || w->occurrences == NULL || w->offsets == NULL || w->level_factors == NULL || w->rows == NULL || w->prefix_scores == NULL || w->suffix_bounds == NULL) { free_buffers(w); return false; }
+    w->needle_capacity = needle_len;
+    w->max_haystack_len = max_haystack_len;
+    w->address = w->positions_count + needle_len;
+    return true;
+}
+
 void*
-alloc_workspace(len_t max_haystack_len, GlobalData *global) {
-    WorkSpace *ans = calloc(1, sizeof(WorkSpace));
-    if (ans == NULL) return NULL;
-    ans->positions_buf = (len_t*) calloc(global->needle_len, sizeof(len_t) * max_haystack_len);
-    ans->positions = (len_t**)calloc(global->needle_len, sizeof(len_t*));
-    ans->positions_count = (len_t*)calloc(2*global->needle_len, sizeof(len_t));
-    ans->level_factors = (uint8_t*)calloc(max_haystack_len, sizeof(uint8_t));
-    if (ans->positions == NULL || ans->positions_buf == NULL || ans->positions_count == NULL || ans->level_factors == NULL) { free_workspace(ans); return NULL; }
-    ans->needle = global->needle;
-    ans->needle_len = global->needle_len;
-    ans->max_haystack_len = max_haystack_len;
-    ans->level1 = global->level1; ans->level2 = global->level2; ans->level3 = global->level3;
-    ans->level1_len = global->level1_len; ans->level2_len = global->level2_len; ans->level3_len = global->level3_len; 
-    ans->address = ans->positions_count + sizeof(len_t) * global->needle_len;
-    for (len_t i = 0; i < global->needle_len; i++) ans->positions[i] = ans->positions_buf + i * max_haystack_len;
-    return ans;
+alloc_workspace() {
+    return calloc(1, sizeof(WorkSpace));
 }
 
-#define NUKE(x) free(x); x = NULL;
+static void
+index_needle(WorkSpace *w) {
+    // Find the distinct chars of the needle, needle chars that are the same share a position list
+    len_t i, d;
+    for (i = 0, w->distinct_count = 0; i < w->needle_len; i++) {
+        for (d = 0; d < w->distinct_count && w->distinct[d] != w->needle[i]; d++);
+        if (d == w->distinct_count) w->distinct[w->distinct_count++] = w->needle[i];
+        w->distinct_of[i] = d;
+    }
+}
+
+bool
+prepare_workspace(void *v, GlobalData *global) {
+    // Set up a workspace, possibly used for previous queries, for the query in global
+    WorkSpace *w = (WorkSpace*)v;
+    if (!resize_workspace(w, global->needle_len, MAX(w->max_haystack_len, 256))) return false;
+    w->needle = global->needle;
+    w->needle_len = global->needle_len;
+    w->level_table = &global->level_table;
+    w->exhaustive = global->exhaustive;
+    w->min_score = global->min_score;
+    // Level 3 characters and CamelCase give the highest scores, see level_factor_for()
+    w->max_char_factor = 100.0 / (global->level3_len ? 70 : 80);
+    index_needle(w);
+    return true;
+}
+
+bool
+fit_workspace(void *v, len_t haystack_len) {
+    // Grow the workspace, at least twofold, if haystack_len is longer than any haystack seen so far
+    WorkSpace *w = (WorkSpace*)v;
+    if (haystack_len <= w->max_haystack_len) return true;
+    if (!resize_workspace(w, w->needle_len, MAX(haystack_len, MIN(LEN_MAX / 2, w->max_haystack_len) * 2))) return false;
+    index_needle(w);
+    return true;
+}
 
 void*
 free_workspace(void *v) {
     WorkSpace *w = (WorkSpace*)v;
-    NUKE(w->positions_buf);
-    NUKE(w->positions);
-    NUKE(w->positions_count);
-    NUKE(w->level_factors);
+    free_buffers(w);
     free(w);
     return NULL;
 }
 
-static inline bool 
-has_char(text_t *text, len_t sz, text_t ch) {
-    for(len_t i = 0; i < sz; i++) {
-        if(text[i] == ch) return true;
+#define LEVEL_TABLE_HASH(ch) ((size_t)(((ch) * 2654435761u) >> 16) & (LEVEL_TABLE_SPARSE_SIZE - 1))
+
+static void
+add_level(LevelTable *t, text_t *chars, len_t count, uint8_t factor) {
+    size_t h;
+    for (len_t i = 0; i < count; i++) {
+        if (chars[i] < LEVEL_TABLE_DENSE_SIZE) { t->dense[chars[i]] = factor; continue; }
+        for (h = LEVEL_TABLE_HASH(chars[i]); t->sparse_chars[h] && t->sparse_chars[h] != chars[i]; h = (h + 1) & (LEVEL_TABLE_SPARSE_SIZE - 1));
+        if (!t->sparse_chars[h]) t->sparse_count++;
+        t->sparse_chars[h] = chars[i]; t->sparse_factors[h] = factor;
     }
-    return false;
+}
+
+void
+compile_level_table(GlobalData *global) {
+    // Build the table of level factors, so that classifying a character is a
+    // single lookup. Lower levels are added last so that they take
+    // precedence for characters present in more than one level. The sparse
+    // table can hold at most 3 * LEVEL_MAX characters, so it is never full.
+    LevelTable *t = &global->level_table;
+    memset(t, 0, sizeof(*t));
+    add_level(t, global->level3, global->level3_len, 70);
+    add_level(t, global->level2, global->level2_len, 80);
+    add_level(t, global->level1, global->level1_len, 90);
 }
 
 static inline uint8_t
-level_factor_for(text_t current, text_t last, WorkSpace *w) {
-    text_t lch = LOWERCASE(last);
-    if (has_char(w->level1, w->level1_len, lch)) return 90;
-    if (has_char(w->level2, w->level2_len, lch)) return 80;
-    if (IS_LOWERCASE(last) && IS_UPPERCASE(current)) return 80; // CamelCase
-    if (has_char(w->level3, w->level3_len, lch)) return 70;
+level_of(LevelTable *t, text_t ch) {
+    size_t h;
+    if (ch < LEVEL_TABLE_DENSE_SIZE) return t->dense[ch];
+    if (!t->sparse_count) return 0;
+    for (h = LEVEL_TABLE_HASH(ch); t->sparse_chars[h]; h = (h + 1) & (LEVEL_TABLE_SPARSE_SIZE - 1)) {
+        if (t->sparse_chars[h] == ch) return t->sparse_factors[h];
+    }
     return 0;
 }
 
-static void
-init_workspace(WorkSpace *w, text_t *haystack, len_t haystack_len) {
-    // Calculate the positions and level_factors arrays for the specified haystack
-    bool level_factor_calculated = false;
-    memset(w->positions_count, 0, sizeof(*(w->positions_count)) * 2 * w->needle_len);
-    memset(w->level_factors, 0, sizeof(*(w->level_factors)) * w->max_haystack_len);
-    for (len_t i = 0; i < haystack_len; i++) {
-        level_factor_calculated = false;
-        for (len_t j = 0; j < w->needle_len; j++) {
-            if (w->needle[j] == LOWERCASE(haystack[i])) {
-                if (!level_factor_calculated) {
-                    level_factor_calculated = true;
-                    w->level_factors[i] = i > 0 ? level_factor_for(haystack[i], haystack[i-1], w) : 0;
-                }
-                w->positions[j][w->positions_count[j]++] = i;
-            }
-        }
-    }
-    w->haystack = haystack;
-    w->haystack_len = haystack_len;
-    w->max_score_per_char = (1.0 / haystack_len + 1.0 / w->needle_len) / 2.0;
+static inline uint8_t
+level_factor_for(text_t current, text_t last, WorkSpace *w) {
+    uint8_t factor = level_of(w->level_table, LOWERCASE(last));
+    if (factor < 80 && IS_LOWERCASE(last) && IS_UPPERCASE(current)) return 80; // CamelCase
+    return factor;
 }
 
+static inline len_t
+find_char(text_t *haystack, len_t i, len_t haystack_len, text_t ch) {
+    // Return the first position >= i whose lowercased character is ch, or haystack_len if there is none
+    text_t uch = IS_LOWERCASE(ch) ? ch - 32 : ch;
+#if defined(__AVX2__)
+    __m256i vch = _mm256_set1_epi32((int)ch), vuch = _mm256_set1_epi32((int)uch), chunk;
+    unsigned int mask;
+    for (; haystack_len - i >= 8; i += 8) {
+        chunk = _mm256_loadu_si256((const __m256i*)(haystack + i));
+        mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_or_si256(_mm256_cmpeq_epi32(chunk, vch), _mm256_cmpeq_epi32(chunk, vuch))));
+        if (mask) return i + ctz(mask);
+    }
+#elif defined(USE_SSE2)
+    __m128i vch = _mm_set1_epi32((int)ch), vuch = _mm_set1_epi32((int)uch), chunk;
+    unsigned int mask;
+    for (; haystack_len - i >= 4; i += 4) {
+        chunk = _mm_loadu_si128((const __m128i*)(haystack + i));
+        mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(_mm_cmpeq_epi32(chunk, vch), _mm_cmpeq_epi32(chunk, vuch))));
+        if (mask) return i + ctz(mask);
+    }
+#endif
+    for (; i < haystack_len; i++) {
+        if (haystack[i] == ch || haystack[i] == uch) return i;
+    }
+    return haystack_len;
+}
 
-static inline bool
-has_atleast_one_match(WorkSpace *w) {
-    int p = -1;
-    bool found;
-    for (len_t i = 0; i < w->needle_len; i++) {
-        if (w->positions_count[i] == 0) return false;  // All characters of the needle are not present in the haystack
-        found = false;
-        for (len_t j = 0; j < w->positions_count[i]; j++) {
-            if (w->positions[i][j] > p) { p = w->positions[i][j]; found = true; break; }
-        }
-        if (!found) return false; // Characters of needle not present in sequence in haystack
+static inline len_t
+find_byte(uint8_t *haystack, len_t i, len_t haystack_len, text_t ch) {
+    // The same as find_char() for a haystack of ASCII bytes
+    if (ch > 0x7f) return haystack_len;
+    uint8_t bch = (uint8_t)ch, ubch = (uint8_t)(IS_LOWERCASE(ch) ? ch - 32 : ch);
+#if defined(__AVX2__)
+    __m256i vch = _mm256_set1_epi8((char)bch), vuch = _mm256_set1_epi8((char)ubch), chunk;
+    unsigned int mask;
+    for (; haystack_len - i >= 32; i += 32) {
+        chunk = _mm256_loadu_si256((const __m256i*)(haystack + i));
+        mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, vch), _mm256_cmpeq_epi8(chunk, vuch)));
+        if (mask) return i + ctz(mask);
     }
-    return true;
+#elif defined(USE_SSE2)
+    __m128i vch = _mm_set1_epi8((char)bch), vuch = _mm_set1_epi8((char)ubch), chunk;
+    unsigned int mask;
+    for (; haystack_len - i >= 16; i += 16) {
+        chunk = _mm_loadu_si128((const __m128i*)(haystack + i));
+        mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, vch), _mm_cmpeq_epi8(chunk, vuch)));
+        if (mask) return i + ctz(mask);
+    }
+#endif
+    for (; i < haystack_len; i++) {
+        if (haystack[i] == bch || haystack[i] == ubch) return i;
+    }
+    return haystack_len;
 }
 
-#define POSITION(x) w->positions[x][w->address[x]]
+static inline unsigned int
+match_chars(text_t *haystack, text_t ch) {
+    // Bit k is set if the lowercased haystack[k] is ch, for the first CHAR_LANES characters of haystack
+    text_t uch = IS_LOWERCASE(ch) ? ch - 32 : ch;
+#if defined(__AVX2__)
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)haystack);
+    return (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_or_si256(_mm256_cmpeq_epi32(chunk, _mm256_set1_epi32((int)ch)), _mm256_cmpeq_epi32(chunk, _mm256_set1_epi32((int)uch)))));
+#elif defined(USE_SSE2)
+    __m128i chunk = _mm_loadu_si128((const __m128i*)haystack);
+    return (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(_mm_cmpeq_epi32(chunk, _mm_set1_epi32((int)ch)), _mm_cmpeq_epi32(chunk, _mm_set1_epi32((int)uch)))));
+#else
+    unsigned int mask = 0;
+    for (unsigned int k = 0; k < CHAR_LANES; k++) if (haystack[k] == ch || haystack[k] == uch) mask |= 1u << k;
+    return mask;
+#endif
+}
 
-static inline bool
-increment_address(WorkSpace *w) {
-    len_t pos = w->needle_len - 1;
-    while(true) {
-        w->address[pos]++;
-        if (w->address[pos] < w->positions_count[pos]) return true;
-        if (pos == 0) break;
-        w->address[pos--] = 0;
-    }
-    return false;
+static inline unsigned int
+match_bytes(uint8_t *haystack, text_t ch) {
+    // The same as match_chars() for a haystack of ASCII bytes
+    if (ch > 0x7f) return 0;
+    uint8_t bch = (uint8_t)ch, ubch = (uint8_t)(IS_LOWERCASE(ch) ? ch - 32 : ch);
+#if defined(__AVX2__)
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)haystack);
+    return (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8((char)bch)), _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8((char)ubch))));
+#elif defined(USE_SSE2)
+    __m128i chunk = _mm_loadu_si128((const __m128i*)haystack);
+    return (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8((char)bch)), _mm_cmpeq_epi8(chunk, _mm_set1_epi8((char)ubch))));
+#else
+    unsigned int mask = 0;
+    for (unsigned int k = 0; k < BYTE_LANES; k++) if (haystack[k] == bch || haystack[k] == ubch) mask |= 1u << k;
+    return mask;
+#endif
 }
 
-static inline bool
-address_is_monotonic(WorkSpace *w) {
-    // Check if the character positions pointed to by the current address are monotonic
-    for (len_t i = 1; i < w->needle_len; i++) {
-        if (POSITION(i) <= POSITION(i-1)) return false;
+// The functions that need to look at the characters of the haystack are
+// defined once for haystacks of decoded text and once for haystacks of ASCII
+// bytes, everything else only uses the positions and level_factors arrays.
+#define DEFINE_HAYSTACK_FUNCTIONS(suffix, CHAR_T, find, match, LANES) \
+static ALWAYS_INLINE bool \
+is_subsequence##suffix(CHAR_T *haystack, len_t haystack_len, const text_t *needle, const len_t needle_len) { \
+    /* Check if the needle occurs in the haystack at all, without touching any of the workspace buffers */ \
+    len_t pos = 0; \
+    if (needle_len > haystack_len) return false; \
+    for (len_t j = 0; j < needle_len; j++) { \
+        pos = find(haystack, pos, haystack_len, needle[j]); \
+        if (pos >= haystack_len) return false; \
+        pos++; \
+    } \
+    return true; \
+} \
+\
+static ALWAYS_INLINE void \
+init_workspace##suffix(WorkSpace *w, CHAR_T *haystack, len_t haystack_len, const len_t needle_len) { \
+    /* Calculate the positions and level_factors arrays for the specified haystack. \
+     * The positions of every distinct needle char are first collected in a \
+     * bitmask in a single pass over the haystack, LANES chars at a time, \
+     * then read out of the masks in order. Nothing is cleared between \
+     * haystacks: the first chunk of every mask word overwrites it and only \
+     * the level factors of matching positions are ever read. */ \
+    len_t i, d, k, pos, count, offset = 0, words = haystack_len / 64 + 1; \
+    uint64_t *mask, bits; \
+    for (i = 0; haystack_len - i >= LANES; i += LANES) { \
+        for (d = 0; d < w->distinct_count; d++) { \
+            bits = (uint64_t)match(haystack + i, w->distinct[d]) << (i % 64); \
+            if (i % 64) w->masks[d * w->mask_words + i / 64] |= bits; \
+            else w->masks[d * w->mask_words + i / 64] = bits; \
+        } \
+    } \
+    /* The remaining chars all fall in the word containing i, which also \
+     * covers the word just past the haystack when it ends on a word boundary */ \
+    for (d = 0; d < w->distinct_count; d++) { \
+        for (k = i, bits = 0; k < haystack_len; k++) { \
+            if (w->distinct[d] == LOWERCASE((text_t)haystack[k])) bits |= (uint64_t)1 << (k % 64); \
+        } \
+        if (i % 64) w->masks[d * w->mask_words + i / 64] |= bits; \
+        else w->masks[d * w->mask_words + i / 64] = bits; \
+    } \
+    for (d = 0; d < w->distinct_count; d++) { \
+        mask = w->masks + d * w->mask_words; \
+        for (k = 0, count = 0; k < words; k++) { \
+            w->ranks[d * w->mask_words + k] = count; \
+            for (bits = mask[k]; bits; bits &= bits - 1) { \
+                pos = 64 * k + ctz64(bits); \
+                w->positions_buf[offset + count++] = pos; \
+                w->level_factors[pos] = pos > 0 ? level_factor_for(haystack[pos], haystack[pos-1], w) : 0; \
+            } \
+        } \
+        w->occurrences[d] = count; w->offsets[d] = offset; \
+        offset += count; \
+    } \
+    for (i = 0; i < needle_len; i++) { \
+        w->positions[i] = w->positions_buf + w->offsets[w->distinct_of[i]]; \
+        w->positions_count[i] = w->occurrences[w->distinct_of[i]]; \
+    } \
+    w->haystack_len = haystack_len; \
+    w->max_score_per_char = (1.0 / haystack_len + 1.0 / needle_len) / 2.0; \
+}
+
+DEFINE_HAYSTACK_FUNCTIONS(, text_t, find_char, match_chars, CHAR_LANES)
+DEFINE_HAYSTACK_FUNCTIONS(_bytes, uint8_t, find_byte, match_bytes, BYTE_LANES)
+
+#define POSITION(x) w->positions[x][address[x]]
+
+static inline double
+special_score(WorkSpace *w, len_t pos) {
+    // The score of a character at a special location, wherever the previous one is
+    return (100 * w->max_score_per_char) / w->level_factors[pos];
+}
+
+static inline double
+distance_score(WorkSpace *w, len_t distance) {
+    // The score of a character at any other location, falling with its distance from the previous one
+    return (0.75 * w->max_score_per_char) / distance;
+}
+
+static inline double
+char_score(WorkSpace *w, len_t i, len_t pos, len_t prev_pos) {
+    // The score contributed by needle[i] matching at pos, when needle[i-1] matched at prev_pos
+    len_t distance;
+    if (i == 0) distance = pos < LEN_MAX ? pos + 1 : LEN_MAX;
+    else {
+        distance = pos - prev_pos;
+        if (distance < 2) return w->max_score_per_char; // consecutive characters
     }
-    return true;
+    if (w->level_factors[pos]) return special_score(w, pos);
+    return distance_score(w, distance);
 }
 
 static inline double
 calc_score(WorkSpace *w) {
     double ans = 0;
-    len_t distance, pos;
+    len_t *address = w->address;
     for (len_t i = 0; i < w->needle_len; i++) {
-        pos = POSITION(i);
-        if (i == 0) distance = pos < LEN_MAX ? pos + 1 : LEN_MAX;
-        else {
-            distance = pos - POSITION(i-1);
-            if (distance < 2) {
-                ans += w->max_score_per_char; // consecutive characters
-                continue;
-            }
-        }
-        if (w->level_factors[pos]) ans += (100 * w->max_score_per_char) / w->level_factors[pos];  // at a special location
-        else ans += (0.75 * w->max_score_per_char) / distance;
+        ans += char_score(w, i, POSITION(i), i > 0 ? POSITION(i-1) : 0);
     }
     return ans;
 }
 
+static double
+calc_suffix_bounds(WorkSpace *w) {
+    // suffix_bounds[i] is an upper bound on the score needle[i+1..] can add
+    // to any alignment. A character can at best be consecutive to the
+    // previous one or be at the best special location it occurs at. Returns
+    // the allowance for rounding errors to use when comparing with them, as
+    // they are summed in a different order than the scores.
+    double bound = 0, char_bound;
+    len_t i = w->needle_len - 1, j, pos;
+    while (true) {
+        w->suffix_bounds[i] = bound;
+        if (i == 0) break;
+        char_bound = w->max_score_per_char;
+        for (j = 0; j < w->positions_count[i]; j++) {
+            pos = w->positions[i][j];
+            if (w->level_factors[pos]) char_bound = MAX(char_bound, special_score(w, pos));
+        }
+        bound += char_bound;
+        i--;
+    }
+    return (2 * w->suffix_bounds[0] + w->max_score_per_char) * DBL_EPSILON * 4 * (w->needle_len + 1);
+}
+
+static inline len_t
+first_after(WorkSpace *w, len_t i, len_t pos) {
+    // The index of the first position of needle[i] after pos, the number of
+    // positions up to and including pos
+    len_t d = w->distinct_of[i], k = (pos + 1) / 64, b = (pos + 1) % 64;
+    return w->ranks[d * w->mask_words + k] + popcount64(w->masks[d * w->mask_words + k] & (((uint64_t)1 << b) - 1));
+}
+
 static double
 process_item(WorkSpace *w, len_t *match_positions) {
-    double highscore = 0, score;
-    do {
-        if (!address_is_monotonic(w)) continue;
-        score = calc_score(w);
-        if (score > highscore) {
-            highscore = score;
-            for (len_t i = 0; i < w->needle_len; i++) match_positions[i] = POSITION(i);
+    // Enumerate every monotonic address in order, keeping the first one with
+    // the highest score. Each character starts at the first position after
+    // the previous one. Partial addresses that cannot beat the highscore even
+    // if all remaining characters score as well as possible are abandoned
+    // together with all their extensions. The highscore starts at the
+    // minimum score, so that weak candidates are abandoned early.
+    double highscore = w->min_score, score, tolerance;
+    bool found = false;
+    len_t i = 0, pos, prev_pos = 0, *address = w->address;
+    tolerance = calc_suffix_bounds(w);
+    address[0] = 0;
+    while (true) {
+        if (address[i] >= w->positions_count[i]) {
+            if (i == 0) break;
+            address[--i]++;
+            continue;
         }
-    } while(increment_address(w));
-    return highscore;
+        if (i > 0) prev_pos = POSITION(i-1);
+        pos = POSITION(i);
+        score = (i > 0 ? w->prefix_scores[i-1] : 0) + char_score(w, i, pos, prev_pos);
+        if (score + w->suffix_bounds[i] + tolerance <= highscore) { address[i]++; continue; }
+        if (i == w->needle_len - 1) {
+            if (score > highscore || (!found && score == highscore)) {
+                highscore = score; found = true;
+                for (len_t k = 0; k < w->needle_len; k++) match_positions[k] = POSITION(k);
+            }
+            address[i]++;
+            continue;
+        }
+        w->prefix_scores[i++] = score;
+        address[i] = first_after(w, i, pos);
+    }
+    return found ? highscore : 0;
 }
 
-double
-score_item(void *v, text_t *haystack, len_t haystack_len, len_t *match_positions) {
-    WorkSpace *w = (WorkSpace*)v;
-    init_workspace(w, haystack, haystack_len);
-    if (!has_atleast_one_match(w)) return 0;
-    return process_item(w, match_positions);
+static inline double
+envelope_value(WorkSpace *w, Envelope *e, len_t pos) {
+    return e->score + distance_score(w, e->pos < pos ? pos - e->pos : e->pos - pos);
+}
+
+static inline len_t
+nth_query(const len_t *queries, len_t count, len_t t, bool reverse) {
+    return queries[reverse ? count - 1 - t : t];
+}
+
+static void
+envelope_add(WorkSpace *w, len_t *top, double score, len_t pos, const len_t *queries, len_t count, len_t t, bool reverse) {
+    // Add a candidate at pos to the upper envelope of the distance scores
+    // of the queries t.. (in reverse order when reverse is true). Candidates
+    // are added nearest to the queries last. The score of a newer candidate
+    // falls faster with the distance than that of an older one, so it can
+    // only be the best for some queries right after t. The entries of the
+    // envelope are the best for consecutive intervals of queries, the top one
+    // for the earliest, so each candidate is found to be the best for a
+    // (possibly empty) interval with one binary search and removes the
+    // entries it beats for all of theirs.
+    Envelope *e = w->envelope, n = {score, pos, count}, *last;
+    len_t start = t, lo, hi, mid, q;
+    while (*top > 0) {
+        last = e + *top - 1;
+        q = nth_query(queries, count, last->until - 1, reverse);
+        if (envelope_value(w, &n, q) >= envelope_value(w, last, q)) { start = last->until; (*top)--; continue; }
+        for (lo = start, hi = last->until - 1; lo < hi;) {
+            mid = lo + (hi - lo) / 2;
+            q = nth_query(queries, count, mid, reverse);
+            if (envelope_value(w, &n, q) >= envelope_value(w, last, q)) lo = mid + 1;
+            else hi = mid;
+        }
+        n.until = lo;
+        break;
+    }
+    if (n.until > t) e[(*top)++] = n;
 }
+
+static bool
+fit_rows(WorkSpace *w, const len_t needle_len) {
+    // Size the buffers of the dynamic programming pass by the positions in
+    // the current haystack, growing them at least twofold when they are too
+    // small. Returns false if they cannot be allocated.
+    size_t total = 0, capacity;
+    len_t i, widest = 0;
+    for (i = 0; i < needle_len; i++) {
+        w->rows[i] = total;
+        total += w->positions_count[i];
+        widest = MAX(widest, w->positions_count[i]);
+    }
+    if (total > w->best_capacity) {
+        capacity = MAX(total, MIN(SIZE_MAX / sizeof(double) / 2, w->best_capacity) * 2);
+        NUKE(w->best); w->best_capacity = 0;
+        if (total > SIZE_MAX / sizeof(double) || (w->best = (double*)malloc(capacity * sizeof(double))) == NULL) return false;
+        w->best_capacity = capacity;
+    }
+    if (widest > w->row_capacity) {
+        capacity = MAX(widest, MIN(LEN_MAX / 2, w->row_capacity) * 2);
+        NUKE(w->row_best); NUKE(w->envelope); w->row_capacity = 0;
+        if ((w->row_best = (double*)malloc(capacity * sizeof(double))) == NULL) return false;
+        if ((w->envelope = (Envelope*)malloc(capacity * sizeof(Envelope))) == NULL) return false;
+        w->row_capacity = (len_t)capacity;
+    }
+    return true;
+}
+
+// The remainder scores replace the prefix scores of a row once they are no longer needed
+#define BEST_PREFIX(i, j) w->best[w->rows[i] + (j)]
+#define BEST_SUFFIX(i, j) w->best[w->rows[i] + (j)]
+
+static ALWAYS_INLINE double
+process_item_dp(WorkSpace *w, len_t *match_positions, const len_t needle_len, len_t *address, double *prefix_scores) {
+    // Finds the same alignment as process_item(), without enumerating every
+    // address. The score of needle[i] depends only on its position and that
+    // of needle[i-1], so dynamic programming over (needle index, position)
+    // gives both the best score of every prefix of an alignment and the best
+    // score of every remainder of one. Since floating point addition is
+    // monotonic, the best prefix scores give exactly the highscore that
+    // process_item() would find. The remainder scores then guide a search, in
+    // the same order as process_item(), for the first alignment that
+    // reaches that highscore, skipping everything that cannot. With a
+    // minimum score, prefixes that cannot reach it even if the rest of the
+    // needle scores as well as possible are dropped as they are found.
+    double highscore = 0, score, tolerance, bounds_tolerance = 0;
+    len_t i, j, k, pos, prev_pos = 0, top;
+    bool prune = w->min_score > 0;
+    if (prune) bounds_tolerance = calc_suffix_bounds(w);
+    for (j = 0; j < w->positions_count[0]; j++) BEST_PREFIX(0, j) = 0 + char_score(w, 0, w->positions[0][j], 0);
+    for (i = 1; i < needle_len; i++) {
+        // row_best[k] is the highest of BEST_PREFIX(i-1, 0..k). A
+        // special location scores the same for every non-consecutive
+        // predecessor, so only the best of them matters. Otherwise the score
+        // falls with distance, and the best predecessor is the top of the
+        // upper envelope of all the ones before pos. The consecutive
+        // predecessor scores less in the envelope than it does as such, so
+        // it does no harm there.
+        score = -1;
+        for (k = 0; k < w->positions_count[i-1]; k++) {
+            if (prune && BEST_PREFIX(i-1, k) + w->suffix_bounds[i-1] + bounds_tolerance < w->min_score) BEST_PREFIX(i-1, k) = -1;
+            w->row_best[k] = score = MAX(score, BEST_PREFIX(i-1, k));
+        }
+        if (score < 0) return 0;  // no prefix can be completed
+        for (j = 0, k = 0, top = 0; j < w->positions_count[i]; j++) {
+            pos = w->positions[i][j];
+            BEST_PREFIX(i, j) = -1;
+            while (top > 0 && w->envelope[top-1].until <= j) top--;
+            for (; k < w->positions_count[i-1] && w->positions[i-1][k] < pos; k++) {
+                if (BEST_PREFIX(i-1, k) >= 0) envelope_add(w, &top, BEST_PREFIX(i-1, k), w->positions[i-1][k], w->positions[i], w->positions_count[i], j, false);
+            }
+            if (k == 0) continue;
+            len_t last = k - 1;
+            if (w->positions[i-1][last] + 1 == pos) {
+                if (BEST_PREFIX(i-1, last) >= 0) BEST_PREFIX(i, j) = BEST_PREFIX(i-1, last) + char_score(w, i, pos, pos - 1);
+                if (last-- == 0) continue;
+            }
+            if (w->level_factors[pos]) {
+                if (w->row_best[last] < 0) continue;  // no alignment of needle[0..i-1] ends before pos
+                score = w->row_best[last] + special_score(w, pos);
+            } else if (top > 0) score = envelope_value(w, w->envelope + top - 1, pos);
+            else continue;
+            if (score > BEST_PREFIX(i, j)) BEST_PREFIX(i, j) = score;
+        }
+    }
+    i = needle_len - 1;
+    for (j = 0; j < w->positions_count[i]; j++) {
+        if (BEST_PREFIX(i, j) > highscore) highscore = BEST_PREFIX(i, j);
+        BEST_SUFFIX(i, j) = 0;
+    }
+    if (highscore <= 0 || highscore < w->min_score) return 0;
+    while (i-- > 0) {
+        // The same, in reverse: row_best[k] is the highest remainder,
+        // including the score of needle[i+1], starting at a special location
+        // in positions[i+1][k..]. The remainders starting at other locations
+        // are in the envelope, nearest last.
+        double special = -1;
+        for (k = w->positions_count[i+1]; k-- > 0;) {
+            pos = w->positions[i+1][k];
+            if (BEST_SUFFIX(i+1, k) >= 0 && w->level_factors[pos]) special = MAX(special, special_score(w, pos) + BEST_SUFFIX(i+1, k));
+            w->row_best[k] = special;
+        }
+        for (j = w->positions_count[i], k = w->positions_count[i+1], top = 0; j-- > 0;) {
+            pos = w->positions[i][j];
+            len_t t = w->positions_count[i] - 1 - j;
+            BEST_SUFFIX(i, j) = -1;
+            while (top > 0 && w->envelope[top-1].until <= t) top--;
+            for (; k > 0 && w->positions[i+1][k-1] > pos; k--) {
+                if (BEST_SUFFIX(i+1, k-1) >= 0 && !w->level_factors[w->positions[i+1][k-1]]) envelope_add(w, &top, BEST_SUFFIX(i+1, k-1), w->positions[i+1][k-1], w->positions[i], w->positions_count[i], t, true);
+            }
+            len_t first = k;
+            if (first < w->positions_count[i+1] && w->positions[i+1][first] == pos + 1) {
+                if (BEST_SUFFIX(i+1, first) >= 0) BEST_SUFFIX(i, j) = char_score(w, i + 1, pos + 1, pos) + BEST_SUFFIX(i+1, first);
+                first++;
+            }
+            if (first >= w->positions_count[i+1]) continue;
+            if (w->row_best[first] > BEST_SUFFIX(i, j)) BEST_SUFFIX(i, j) = w->row_best[first];
+            if (top > 0) {
+                score = envelope_value(w, w->envelope + top - 1, pos);
+                if (score > BEST_SUFFIX(i, j)) BEST_SUFFIX(i, j) = score;
+            }
+        }
+    }
+
+    // The remainder scores are summed in a different order, so allow for rounding errors
+    tolerance = highscore * DBL_EPSILON * 4 * (needle_len + 1);
+    i = 0; address[0] = 0;
+    while (true) {
+        if (address[i] >= w->positions_count[i]) {
+            if (i == 0) break;  // cannot happen, highscore is the score of some alignment
+            address[--i]++;
+            continue;
+        }
+        if (i > 0) prev_pos = POSITION(i-1);
+        pos = POSITION(i);
+        if (BEST_SUFFIX(i, address[i]) < 0) { address[i]++; continue; }
+        score = (i > 0 ? prefix_scores[i-1] : 0) + char_score(w, i, pos, prev_pos);
+        if (score + BEST_SUFFIX(i, address[i]) + tolerance < highscore) { address[i]++; continue; }
+        if (i == needle_len - 1) {
+            if (score == highscore) {
+                for (i = 0; i < needle_len; i++) match_positions[i] = POSITION(i);
+                return highscore;
+            }
+            address[i]++;
+            continue;
+        }
+        prefix_scores[i++] = score;
+        address[i] = first_after(w, i, pos);
+    }
+    return 0;
+}
+
+static inline bool
+cannot_reach_min_score(WorkSpace *w, len_t haystack_len, len_t needle_len) {
+    // No character can score more than max_char_factor times the score per
+    // char, which depends only on the lengths, so some candidates can be
+    // rejected without looking at them
+    if (w->min_score <= 0) return false;
+    double ceiling = needle_len * w->max_char_factor * (1.0 / haystack_len + 1.0 / needle_len) / 2.0;
+    return ceiling * (1 + DBL_EPSILON * 4 * (needle_len + 1)) < w->min_score;
+}
+
+// Kernels specialized for the common short needles keep the address and the
+// prefix scores in local arrays of constant size, so that the compiler can
+// unroll the loops over the needle and keep them in registers. Longer
+// needles and the exhaustive engine use the generic path.
+// All of them return -1 if the buffers of the dynamic programming pass
+// cannot be allocated.
+
+#define DEFINE_SCORE_KERNELS(suffix, CHAR_T) \
+static double \
+score_generic##suffix(WorkSpace *w, CHAR_T *haystack, len_t haystack_len, len_t *match_positions) { \
+    if (cannot_reach_min_score(w, haystack_len, w->needle_len) || !is_subsequence##suffix(haystack, haystack_len, w->needle, w->needle_len)) return 0; \
+    init_workspace##suffix(w, haystack, haystack_len, w->needle_len); \
+    if (w->exhaustive) return process_item(w, match_positions); \
+    if (!fit_rows(w, w->needle_len)) return -1; \
+    return process_item_dp(w, match_positions, w->needle_len, w->address, w->prefix_scores); \
+} \
+\
+DEFINE_SCORE_KERNEL(suffix, CHAR_T, 1) \
+DEFINE_SCORE_KERNEL(suffix, CHAR_T, 2) \
+DEFINE_SCORE_KERNEL(suffix, CHAR_T, 3) \
+DEFINE_SCORE_KERNEL(suffix, CHAR_T, 4) \
+DEFINE_SCORE_KERNEL(suffix, CHAR_T, 5) \
+DEFINE_SCORE_KERNEL(suffix, CHAR_T, 6) \
+\
+double \
+score_item##suffix(void *v, CHAR_T *haystack, len_t haystack_len, len_t *match_positions) { \
+    WorkSpace *w = (WorkSpace*)v; \
+    switch (w->exhaustive ? 0 : w->needle_len) { \
+        case 1: return score##suffix##_1(w, haystack, haystack_len, match_positions); \
+        case 2: return score##suffix##_2(w, haystack, haystack_len, match_positions); \
+        case 3: return score##suffix##_3(w, haystack, haystack_len, match_positions); \
+        case 4: return score##suffix##_4(w, haystack, haystack_len, match_positions); \
+        case 5: return score##suffix##_5(w, haystack, haystack_len, match_positions); \
+        case 6: return score##suffix##_6(w, haystack, haystack_len, match_positions); \
+        default: return score_generic##suffix(w, haystack, haystack_len, match_positions); \
+    } \
+}
+
+#define DEFINE_SCORE_KERNEL(suffix, CHAR_T, N) \
+static double \
+score##suffix##_##N(WorkSpace *w, CHAR_T *haystack, len_t haystack_len, len_t *match_positions) { \
+    len_t address[N]; double prefix_scores[N]; \
+    if (cannot_reach_min_score(w, haystack_len, N) || !is_subsequence##suffix(haystack, haystack_len, w->needle, N)) return 0; \
+    init_workspace##suffix(w, haystack, haystack_len, N); \
+    if (!fit_rows(w, N)) return -1; \
+    return process_item_dp(w, match_positions, N, address, prefix_scores); \
+}
+
+DEFINE_SCORE_KERNELS(, text_t)
+DEFINE_SCORE_KERNELS(_bytes, uint8_t)
@@ -134,6 +134,33 @@ def newer(dest, *sources):
     return False
 
 
+def find_compression_libraries(env):
+    # The libraries for reading compressed input that can be linked against,
+    # as (define, library) pairs
+    ans = []
+    if iswindows:
+        return ans
+    src = os.path.join(build_dir, 'check-library.c')
+    exe = os.path.join(build_dir, 'check-library')
+    for name, header, lib in (('HAS_ZLIB', 'zlib.h', 'z'), ('HAS_BZIP2', 'bzlib.h', 'bz2'), ('HAS_ZSTD', 'zstd.h', 'zstd')):
+        with open(src, 'w') as f:
+            f.write('#include <%s>\nint main(void) { return 0; }\n' % header)
+        with open(os.devnull, 'wb') as devnull:
+            if subprocess.call([env.cc, src, '-o', exe, '-l' + lib], stdout=devnull, stderr=devnull) == 0:
+                ans.append((name, lib))
+    for x in (src, exe):
+        if os.path.exists(x):
+            os.remove(x)
+    print('Compressed input:', ', '.join(lib for name, lib in ans) or 'not supported')
+    return ans
+
+
+def with_libraries(env, libraries):
+    return env._replace(
+        cflags=env.cflags + [define(name) for name, lib in libraries],
+        ldflags=env.ldflags + ['-l' + lib for name, lib in libraries])
+
+
 def option_parser():
     p = argparse.ArgumentParser()
     p.add_argument(
@@ -220,11 +247,12 @@ def build_exe(objects, env):
 def build(args):
     getopt(args)
     sources, headers = find_c_files()
+    libraries = find_compression_libraries(init_env())
     if not iswindows:
-        env = init_env(debug=True, sanitize=True)
+        env = with_libraries(init_env(debug=True, sanitize=True), libraries)
         debug_objects = [build_obj(c, env) for c in sources]
         build_exe(debug_objects, env)
-    env = init_env()
+    env = with_libraries(init_env(), libraries)
     objects = [build_obj(c, env) for c in sources]
     build_exe(objects, env)
 
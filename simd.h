@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2017 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#pragma once
+
+// The vector instructions available at compile time, and the bit twiddling
+// used to read the masks they produce
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline unsigned int ctz(unsigned int x) { unsigned long i; _BitScanForward(&i, x); return i; }
+static inline unsigned int ctz64(uint64_t x) { unsigned long i; _BitScanForward64(&i, x); return i; }
+#define popcount64(x) ((len_t)__popcnt64(x))
+#define ALWAYS_INLINE __forceinline
+#else
+#define ctz __builtin_ctz
+#define ctz64 __builtin_ctzll
+#define popcount64(x) ((len_t)__builtin_popcountll(x))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#endif
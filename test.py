@@ -6,9 +6,16 @@ from __future__ import (absolute_import, division, print_function,
                         unicode_literals)
 
 import bz2
+import gzip
+import io
+import json
 import os
+import shutil
+import signal
 import subprocess
 import sys
+import tempfile
+import time
 import unittest
 
 base = os.path.dirname(os.path.abspath(__file__))
@@ -23,7 +30,12 @@ def run(input_data,
         delimiter=None,
         level1=None,
         level2=None,
-        level3=None):
+        level3=None,
+        exhaustive=False,
+        min_score=None,
+        limit=None,
+        input_file=None,
+        output_format=None):
     if isinstance(input_data, (list, tuple)):
         input_data = '\n'.join(input_data)
     if not isinstance(input_data, bytes):
@@ -44,6 +56,16 @@ def run(input_data,
         cmd.append('-p')
     if delimiter:
         cmd.extend(('-d', delimiter))
+    if exhaustive:
+        cmd.append('--exhaustive')
+    if min_score is not None:
+        cmd.extend(('--min-score', str(min_score)))
+    if limit is not None:
+        cmd.extend(('--limit', str(limit)))
+    if input_file is not None:
+        cmd.extend(('--input', input_file))
+    if output_format is not None:
+        cmd.extend(('--format', output_format))
     for i in '123':
         val = locals()['level' + i]
         if val is not None:
@@ -89,6 +111,19 @@ class TestMatcher(unittest.TestCase):
         self.basic_test('test\nXYZ', 'xy', 'XYZ')
         self.basic_test('test\nXYZ', 'mn', '')
 
+    def test_non_ascii(self):
+        ' Lines that are pure ASCII and lines that are not must be mixable '
+        self.basic_test('xyz\nüaxb\naxb', 'ab', '|a|x|b|\nü|a|x|b|', mark='|')
+        self.basic_test('xyz\nüaxb\naxb\nüb', 'üb', '0,1:üb\n0,3:üaxb', positions=True)
+
+    def test_long_lines(self):
+        ' Lines and queries longer than 255 characters '
+        long_line = 'x' * 300 + 'ab'
+        self.basic_test(long_line + '\nab', 'ab', '0,1:ab\n300,301:' + long_line, positions=True)
+        self.basic_test('a' * 300, 'a' * 280, ','.join(map(str, range(280))) + ':' + 'a' * 300, positions=True)
+        # Many occurrences of every query character, this must not take quadratic time
+        self.basic_test('ab' * 20000, 'a' * 10, ','.join(map(str, range(0, 20, 2))) + ':' + 'ab' * 20000, positions=True)
+
     def test_marking(self):
         ' Marking of matched characters '
         self.basic_test(
@@ -101,6 +136,14 @@ class TestMatcher(unittest.TestCase):
         ' Output of positions '
         self.basic_test('abc\nac', 'ac', '0,1:ac\n0,2:abc', positions=True)
 
+    def test_min_score(self):
+        ' Results below the minimum score must be dropped '
+        data = 'abc\na' + 'x' * 15 + 'b' + 'x' * 15 + 'c\nxyz\nab/c'
+        self.basic_test(data, 'abc', 'abc\nab/c\na' + 'x' * 15 + 'b' + 'x' * 15 + 'c')
+        for exhaustive in (False, True):
+            self.basic_test(data, 'abc', 'abc\nab/c', min_score=0.5, exhaustive=exhaustive)
+            self.basic_test(data, 'abc', '', min_score=1.5, exhaustive=exhaustive)
+
     def test_delimiter(self):
         ' Test using a custom line delimiter '
         self.basic_test('abc\n21ac', 'ac', 'ac1abc\n2', delimiter='1')
@@ -113,6 +156,8 @@ class TestMatcher(unittest.TestCase):
         self.basic_test('xxxy\nxx/y', 'y', 'xx/y\nxxxy')
         # CamelCase
         self.basic_test('xxxy\nxxxY', 'y', 'xxxY\nxxxy')
+        # Non ASCII level characters
+        self.basic_test('xxxy\nxx→y', 'y', 'xx→y\nxxxy', level1='→')
         # Total length
         self.basic_test('xxxya\nxxxy', 'y', 'xxxy\nxxxya')
         # Distance
@@ -122,6 +167,30 @@ class TestMatcher(unittest.TestCase):
         # Highest score
         self.basic_test('xa/a', 'a', 'xa/|a|', mark='|')
 
+    def test_engines(self):
+        ' The dynamic programming and exhaustive engines must give identical results '
+        with open(os.path.join(base, 'test-data', 'qt-files.bz2'), 'rb') as f:
+            data = bz2.decompress(f.read())
+        for query in ('qt', 'core', 'qtgui', 'ssss'):
+            expected = self.run_matcher(data, query, positions=True, exhaustive=True)
+            self.basic_test(data, query, expected, positions=True)
+        self.basic_test('eeee/eeee/eeee', 'eee', '5,6,10:eeee/eeee/eeee', positions=True)
+
+    @unittest.skipIf(iswindows, 'Directories cannot be opened as files on Windows')
+    def test_read_error(self):
+        ' A failure to read STDIN must be reported as such and must not hang the workers '
+        exe = os.path.join(base, 'build', 'subseq-matcher-debug')
+        fd = os.open(base, os.O_RDONLY)
+        try:
+            p = subprocess.Popen([exe, '-t', '3', 'c'], stdin=fd, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+            stdout, stderr = p.communicate(timeout=30)
+        finally:
+            os.close(fd)
+        self.assertEqual(p.returncode, 1)
+        self.assertEqual(stdout, b'')
+        self.assertIn(b'Failed to read the input', stderr)
+        self.assertNotIn(b'Out of memory', stderr)
+
     def test_threading(self):
         ' Test matching on a large data set with different number of threads '
         with open(os.path.join(base, 'test-data', 'qt-files.bz2'), 'rb') as f:
@@ -129,6 +198,130 @@ class TestMatcher(unittest.TestCase):
         for threads in range(4):
             self.basic_test(data, 'qt', None, threads=threads)
 
+    @unittest.skipIf(iswindows, 'Cancelling needs signals')
+    def test_cancel(self):
+        ' A cancelled query must stop without output, even while waiting for input '
+        exe = os.path.join(base, 'build', 'subseq-matcher-debug')
+        p = subprocess.Popen([exe, '-t', '3', 'c'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        p.stdin.write(b'abc\n' * 10000)
+        p.stdin.flush()
+        time.sleep(0.2)
+        p.send_signal(signal.SIGTERM)
+        stdout, stderr = p.communicate()
+        self.assertEqual(p.returncode, 2, stderr.decode('utf-8'))
+        self.assertEqual(stdout, b'')
+
+    def test_cancel_output(self):
+        ' SIGINT while the results are output must terminate the process '
+        exe = os.path.join(base, 'build', 'subseq-matcher-debug')
+        tdir = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tdir, 'input')
+            with open(path, 'wb') as f:
+                f.write(b'abc\n' * 100000)
+            with subprocess.Popen([exe, '-i', path, 'c'], stdout=subprocess.PIPE, stderr=subprocess.PIPE) as p:
+                # The output is not read, so the process blocks writing it
+                self.assertEqual(os.read(p.stdout.fileno(), 1), b'a')
+                p.send_signal(signal.SIGINT)
+                stdout, stderr = p.communicate()
+            self.assertEqual(p.returncode, -signal.SIGINT, stderr.decode('utf-8'))
+            self.assertLess(len(stdout), 100000 * 4 - 1)
+        finally:
+            shutil.rmtree(tdir)
+
+    def test_input_file(self):
+        ' Reading from a mapped file must give the same results as reading from STDIN '
+        with open(os.path.join(base, 'test-data', 'qt-files.bz2'), 'rb') as f:
+            data = bz2.decompress(f.read())
+        # Some non-ASCII lines and no trailing newline
+        data = 'Ĉore/ŝtuff.h\nqcoré.cpp\n'.encode('utf-8') + data.rstrip(b'\n')
+        tdir = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tdir, 'input')
+            with open(path, 'wb') as f:
+                f.write(data)
+            for query in ('core', 'qtgui'):
+                expected = self.run_matcher(data, query, positions=True)
+                self.basic_test(b'', query, expected, positions=True, input_file=path, threads=3)
+            with open(path, 'wb') as f:
+                pass
+            self.basic_test(b'', 'x', [], input_file=path)
+        finally:
+            shutil.rmtree(tdir)
+
+    def test_compressed_input(self):
+        ' Compressed input files must give the same results as uncompressed ones '
+        with open(os.path.join(base, 'test-data', 'qt-files.bz2'), 'rb') as f:
+            compressed = f.read()
+        data = bz2.decompress(compressed)
+        buf = io.BytesIO()
+        with gzip.GzipFile(fileobj=buf, mode='wb') as f:
+            f.write(data)
+        expected = self.run_matcher(data, 'core', positions=True)
+        tdir = tempfile.mkdtemp()
+        try:
+            for name, raw in (('input.bz2', compressed), ('input.gz', buf.getvalue()), ('truncated.gz', buf.getvalue()[:-100])):
+                path = os.path.join(tdir, name)
+                with open(path, 'wb') as f:
+                    f.write(raw)
+                rc, result = run(b'', 'core', positions=True, input_file=path, threads=3)
+                if rc != 0 and 'not supported by this build' in '\n'.join(result):
+                    continue
+                if name.startswith('truncated'):
+                    self.assertEqual(rc, 1, '\n'.join(result))
+                else:
+                    self.assertEqual(rc, 0, '\n'.join(result))
+                    self.assertEqual(result, expected)
+        finally:
+            shutil.rmtree(tdir)
+
+    def test_limit(self):
+        ' The limited results must be the best of the full results, in the same order '
+        with open(os.path.join(base, 'test-data', 'qt-files.bz2'), 'rb') as f:
+            data = bz2.decompress(f.read())
+        expected = self.run_matcher(data, 'core', positions=True)
+        for limit in (1, 20, 1000):
+            for threads in (1, 3):
+                self.basic_test(data, 'core', expected[:limit], positions=True, limit=limit, threads=threads)
+        self.basic_test('abc\nac\nabbc', 'ac', 'ac', limit=1)
+
+    @unittest.skipIf(iswindows, 'Waiting for input with a timeout needs poll()')
+    def test_stream(self):
+        ' Every refresh must output the best results so far and the last one the final results '
+        exe = os.path.join(base, 'build', 'subseq-matcher-debug')
+        with subprocess.Popen([exe, '-t', '3', '--stream', '--stream-marker', '--', '-l', '2', 'ac'], stdin=subprocess.PIPE, stdout=subprocess.PIPE) as p:
+            p.stdin.write(b'abc\nxyz\n')
+            p.stdin.flush()
+            self.assertEqual(p.stdout.readline(), b'abc\n')
+            self.assertEqual(p.stdout.readline(), b'--\n')
+            p.stdin.write(b'ac\nabbc\n')
+            p.stdin.close()
+            self.assertEqual(p.stdout.read().split(b'--\n')[-2], b'ac\nabc\n')
+            self.assertEqual(p.wait(), 0)
+        with open(os.path.join(base, 'test-data', 'qt-files.bz2'), 'rb') as f:
+            data = bz2.decompress(f.read())
+        expected = self.run_matcher(data, 'core', limit=100, positions=True)
+        p = subprocess.Popen([exe, '-t', '3', '--stream', '--refresh-interval', '1', '-p', 'core'], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        frames = p.communicate(data)[0].decode('utf-8').split('\n\n')
+        self.assertEqual(p.wait(), 0)
+        self.assertEqual(frames[-1], '')
+        self.assertEqual(frames[-2].split('\n'), expected)
+
+    def test_jsonl(self):
+        ' The JSON lines output must have the same results as the plain output, and escape the lines '
+        with open(os.path.join(base, 'test-data', 'qt-files.bz2'), 'rb') as f:
+            data = bz2.decompress(f.read())
+        expected = self.run_matcher(data, 'core', positions=True)
+        result = [json.loads(x) for x in self.run_matcher(data, 'core', output_format='jsonl')]
+        self.assertEqual(['%s:%s' % (','.join(map(str, r['positions'])), r['line']) for r in result], expected)
+        scores = [r['score'] for r in result]
+        self.assertEqual(scores, sorted(scores, reverse=True))
+        lines = data.decode('utf-8').splitlines()
+        for r in result:
+            self.assertEqual(lines[r['index']], r['line'])
+        result = [json.loads(x) for x in self.run_matcher('x\n\nüa"b\\c\t\x01', 'ab', output_format='jsonl')]
+        self.assertEqual(result, [{'line': 'üa"b\\c\t\x01', 'index': 2, 'score': result[0]['score'], 'positions': [1, 3]}])
+
 
 if __name__ == '__main__':
     unittest.main(verbosity=2)
@@ -6,6 +6,7 @@
  */
 
 #include "data-types.h"
+#include "simd.h"
 
 // UTF-8 decode taken from: http://bjoern.hoehrmann.de/utf-8/decoder/dfa/
  
@@ -39,23 +40,69 @@ decode_utf8(text_t* state, text_t* codep, uint8_t byte) {
 }
 
 
+bool
+is_ascii(char *src, size_t sz) {
+    uint8_t all = 0;
+    for (size_t i = 0; i < sz; i++) all |= (uint8_t)src[i];
+    return all < 0x80;
+}
+
+static inline size_t
+widen_ascii(const char *src, size_t sz, text_t *dest) {
+    // Copy the leading ASCII bytes of src to dest, returning their number
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; sz - i >= 32; i += 32) {
+        if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(src + i)))) break;
+        for (size_t k = 0; k < 32; k += 8) {
+            _mm256_storeu_si256((__m256i*)(dest + i + k), _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i + k))));
+        }
+    }
+#elif defined(USE_SSE2)
+    __m128i chunk, half, zero = _mm_setzero_si128();
+    for (; sz - i >= 16; i += 16) {
+        chunk = _mm_loadu_si128((const __m128i*)(src + i));
+        if (_mm_movemask_epi8(chunk)) break;
+        half = _mm_unpacklo_epi8(chunk, zero);
+        _mm_storeu_si128((__m128i*)(dest + i), _mm_unpacklo_epi16(half, zero));
+        _mm_storeu_si128((__m128i*)(dest + i + 4), _mm_unpackhi_epi16(half, zero));
+        half = _mm_unpackhi_epi8(chunk, zero);
+        _mm_storeu_si128((__m128i*)(dest + i + 8), _mm_unpacklo_epi16(half, zero));
+        _mm_storeu_si128((__m128i*)(dest + i + 12), _mm_unpackhi_epi16(half, zero));
+    }
+#endif
+    for (; i < sz && (uint8_t)src[i] < 0x80; i++) dest[i] = (uint8_t)src[i];
+    return i;
+}
+
 size_t
-decode_string(char *src, size_t sz, text_t *dest) {
-    // dest must be a zeroed array of size at least sz 
+decode_string(char *src, size_t sz, text_t *dest, bool *valid) {
+    // dest must be an array of size at least sz. Between characters, runs
+    // of ASCII bytes are widened without going through the DFA. If valid is
+    // not NULL, it is set to whether src was valid UTF-8, that is, whether
+    // encoding dest gives back src.
     text_t codep = 0, state = 0, prev = UTF8_ACCEPT;
-    size_t i, d;
+    size_t i, d, n;
+    bool rejected = false;
     for (i = 0, d = 0; i < sz; i++) {
+        if (state == UTF8_ACCEPT) {
+            n = widen_ascii(src + i, sz - i, dest + d);
+            i += n; d += n;
+            if (i >= sz) break;
+        }
         switch(decode_utf8(&state, &codep, src[i])) {
             case UTF8_ACCEPT:
                 dest[d++] = codep;
                 break;
             case UTF8_REJECT:
+                rejected = true;
                 state = UTF8_ACCEPT;
                 if (prev != UTF8_ACCEPT && i > 0) i--;
                 break;
         }
         prev = state;
     }
+    if (valid) *valid = !rejected && state == UTF8_ACCEPT;
     return d;
 }
 
@@ -5,11 +5,27 @@
  * Distributed under terms of the GPL3 license.
  */
 
+#ifdef __linux__
+// For sched_getcpu() and the CPU affinity API
+#define _GNU_SOURCE
+#endif
 #include "data-types.h"
 #include <unistd.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #ifdef __APPLE__
 #ifndef _SC_NPROCESSORS_ONLN
@@ -23,27 +39,321 @@ cpu_count() {
 }
 
 
-void*
-alloc_threads(size_t num_threads) {
-    return calloc(num_threads, sizeof(pthread_t));
+// A pool of worker threads that stay parked between tasks. The thread that
+// runs a task takes part in it as worker 0, so a pool of one worker has no
+// threads at all.
+typedef struct ThreadPool ThreadPool;
+
+typedef struct {
+    ThreadPool *pool;
+    size_t idx;
+} Worker;
+
+struct ThreadPool {
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    pthread_t *threads;
+    Worker *workers;
+    size_t num_workers, running;
+    unsigned long generation;  // Incremented for every task, so that parked workers know there is a new one
+    pool_func func;
+    void *arg;
+    bool shutdown;
+    int *cpus;  // The CPUs the workers are pinned to, in turn, NULL if they are not pinned
+    size_t num_cpus;
+};
+
+static void
+pin_worker(ThreadPool *pool, size_t idx) {
+#ifdef __linux__
+    cpu_set_t set;
+    int rc;
+    if (pool->cpus == NULL) return;
+    CPU_ZERO(&set);
+    CPU_SET(pool->cpus[idx % pool->num_cpus], &set);
+    if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))) fprintf(stderr, "Failed to pin thread to CPU, with error: %s\n", strerror(rc));
+#else
+    (void)pool; (void)idx;
+#endif
 }
 
-bool
-start_thread(void* threads, size_t i, void *(*start_routine) (void *), void *arg) {
+static void
+find_cpus(ThreadPool *pool) {
+    // The CPUs this process may run on, in order
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0 || CPU_COUNT(&set) < 1) return;
+    if ((pool->cpus = (int*)calloc(CPU_COUNT(&set), sizeof(int))) == NULL) return;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) pool->cpus[pool->num_cpus++] = cpu;
+    }
+#else
+    (void)pool;
+    fprintf(stderr, "Pinning threads to CPUs is not supported on this platform\n");
+#endif
+}
+
+static void*
+worker_main(void *w) {
+    Worker *worker = (Worker*)w;
+    ThreadPool *pool = worker->pool;
+    unsigned long generation = 0;
+    pool_func func;
+    void *arg;
+    pin_worker(pool, worker->idx);
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->shutdown && pool->generation == generation) pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->shutdown) break;
+        generation = pool->generation; func = pool->func; arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+        func(arg, worker->idx);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void*
+alloc_thread_pool(size_t num_workers, bool pin) {
+    // With pin, every worker thread is pinned to its own CPU, as far as
+    // there are enough of them. The calling thread, worker 0, is not, as it
+    // also reads the input and writes the output.
     int rc;
-    if ((rc = pthread_create(((pthread_t*)threads) + i, NULL, start_routine, arg))) {
-        fprintf(stderr, "Failed to create thread, with error: %s\n", strerror(rc));
-        return false;
+    ThreadPool *pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+    if (pool == NULL) return NULL;
+    num_workers = MAX(1, num_workers);
+    pool->threads = (pthread_t*)calloc(num_workers, sizeof(pthread_t));
+    pool->workers = (Worker*)calloc(num_workers, sizeof(Worker));
+    if (pool->threads == NULL || pool->workers == NULL) { free(pool->threads); free(pool->workers); free(pool); return NULL; }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    if (pin) find_cpus(pool);
+    // The workers block all signals, so that signals are delivered to the
+    // calling thread, interrupting whatever it is blocked on
+    sigset_t all_signals, old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask);
+    pool->num_workers = 1;
+    for (size_t i = 1; i < num_workers; i++) {
+        pool->workers[i].pool = pool; pool->workers[i].idx = i;
+        if ((rc = pthread_create(pool->threads + i, NULL, worker_main, pool->workers + i))) {
+            // Make do with the workers started so far
+            fprintf(stderr, "Failed to create thread, with error: %s\n", strerror(rc));
+            break;
+        }
+        pool->num_workers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return pool;
+}
+
+size_t
+thread_pool_size(void *pool) {
+    return ((ThreadPool*)pool)->num_workers;
+}
+
+void
+run_in_thread_pool(void *p, pool_func func, void *arg) {
+    // Run func on every worker of the pool and wait for all of them to finish
+    ThreadPool *pool = (ThreadPool*)p;
+    if (pool->num_workers > 1) {
+        pthread_mutex_lock(&pool->lock);
+        pool->func = func; pool->arg = arg;
+        pool->running = pool->num_workers - 1;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    func(arg, 0);
+    if (pool->num_workers > 1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->running) pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
     }
-    return true;
 }
 
 void
-wait_for_thread(void *threads, size_t i) {
-    pthread_join(((pthread_t*)(threads))[i], NULL);
+free_thread_pool(void *p) {
+    ThreadPool *pool = (ThreadPool*)p;
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 1; i < pool->num_workers; i++) pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads); free(pool->workers); free(pool->cpus); free(pool);
+}
+
+typedef struct {
+    pthread_t thread;
+    thread_func func;
+    void *arg;
+} Thread;
+
+static void*
+thread_main(void *t) {
+    ((Thread*)t)->func(((Thread*)t)->arg);
+    return NULL;
+}
+
+void*
+start_thread(thread_func func, void *arg) {
+    // Run func in a thread of its own, that blocks all signals, like the
+    // workers of a pool
+    int rc;
+    sigset_t all_signals, old_mask;
+    Thread *t = (Thread*)calloc(1, sizeof(Thread));
+    if (t == NULL) return NULL;
+    t->func = func; t->arg = arg;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask);
+    rc = pthread_create(&t->thread, NULL, thread_main, t);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (rc) { fprintf(stderr, "Failed to create thread, with error: %s\n", strerror(rc)); free(t); return NULL; }
+    return t;
 }
 
 void
-free_threads(void *threads) {
-    free(threads);
+join_thread(void *t) {
+    pthread_join(((Thread*)t)->thread, NULL);
+    free(t);
+}
+
+static void (*cancel_callback)(void) = NULL;
+
+static void
+on_cancel_signal(int sig) {
+    (void)sig;
+    if (cancel_callback) cancel_callback();
+}
+
+bool
+handle_cancel_signals(void (*callback)(void)) {
+    // Call callback on SIGINT and SIGTERM, from the signal handler. Blocking
+    // system calls are interrupted rather than restarted.
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = on_cancel_signal;
+    sigemptyset(&act.sa_mask);
+    cancel_callback = callback;
+    return sigaction(SIGINT, &act, NULL) == 0 && sigaction(SIGTERM, &act, NULL) == 0;
+}
+
+void
+restore_cancel_signals() {
+    // Back to the default handling of SIGINT and SIGTERM
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = SIG_DFL;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGINT, &act, NULL); sigaction(SIGTERM, &act, NULL);
+    cancel_callback = NULL;
+}
+
+void*
+map_file(const char *path, size_t *size) {
+    // Map the file read only, for reading sequentially. Returns NULL, after
+    // reporting the error, on failure.
+    static char empty[1] = {0};
+    struct stat st;
+    void *ans;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { fprintf(stderr, "Failed to open %s with error: %s\n", path, strerror(errno)); return NULL; }
+    if (fstat(fd, &st) != 0) { fprintf(stderr, "Failed to stat %s with error: %s\n", path, strerror(errno)); close(fd); return NULL; }
+    *size = st.st_size;
+    if (*size == 0) { close(fd); return empty; }
+    ans = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ans == MAP_FAILED) { fprintf(stderr, "Failed to map %s with error: %s\n", path, strerror(errno)); return NULL; }
+    posix_madvise(ans, *size, POSIX_MADV_SEQUENTIAL);
+    return ans;
+}
+
+void
+unmap_file(void *addr, size_t size) {
+    if (size > 0) munmap(addr, size);
+}
+
+ssize_t
+read_stdin(char *buf, size_t sz) {
+    return read(STDIN_FILENO, buf, sz);
+}
+
+bool
+stdin_ready(double timeout) {
+    // Whether STDIN can be read without blocking, waiting up to timeout
+    // seconds for it. Errors are left for the read to report.
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    int ret = poll(&pfd, 1, timeout > 0 ? (int)MIN(timeout * 1000 + 1, INT_MAX) : 0);
+    return ret != 0 && !(ret < 0 && errno == EINTR);
+}
+
+size_t
+stdin_size() {
+    // The size of STDIN if it is a regular file, otherwise zero
+    struct stat st;
+    if (fstat(fileno(stdin), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 0) return 0;
+    return (size_t)st.st_size;
+}
+
+int
+current_cpu() {
+#ifdef __linux__
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+int
+cpu_numa_node(int cpu) {
+    // The NUMA node the CPU belongs to, as listed in sysfs, or -1 if not known
+    char path[128];
+    if (cpu < 0) return -1;
+    for (int node = 0; node < 64; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpu%d", node, cpu);
+        if (access(path, F_OK) == 0) return node;
+    }
+    return -1;
+}
+
+// A lock with a condition to wait on, for sharing state between threads
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Monitor;
+
+void*
+alloc_monitor() {
+    Monitor *m = (Monitor*)calloc(1, sizeof(Monitor));
+    if (m == NULL) return NULL;
+    if (pthread_mutex_init(&m->lock, NULL) != 0) { free(m); return NULL; }
+    if (pthread_cond_init(&m->cond, NULL) != 0) { pthread_mutex_destroy(&m->lock); free(m); return NULL; }
+    return m;
+}
+
+void lock_monitor(void *m) { pthread_mutex_lock(&((Monitor*)m)->lock); }
+void unlock_monitor(void *m) { pthread_mutex_unlock(&((Monitor*)m)->lock); }
+void wait_on_monitor(void *m) { pthread_cond_wait(&((Monitor*)m)->cond, &((Monitor*)m)->lock); }
+void notify_monitor(void *m) { pthread_cond_broadcast(&((Monitor*)m)->cond); }
+
+void
+free_monitor(void *m) {
+    if (m == NULL) return;
+    pthread_cond_destroy(&((Monitor*)m)->cond);
+    pthread_mutex_destroy(&((Monitor*)m)->lock);
+    free(m);
+}
+
+double
+monotonic_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
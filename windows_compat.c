@@ -11,6 +11,10 @@
 #include <process.h>
 #include <stdio.h>
 #include <errno.h>
+#include <io.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 int 
 cpu_count() {
@@ -19,89 +23,274 @@ cpu_count() {
     return sysinfo.dwNumberOfProcessors;
 }
 
+// The same thread pool as in unix_compat.c, on top of the native condition variables
+typedef struct ThreadPool ThreadPool;
+
+typedef struct {
+    ThreadPool *pool;
+    size_t idx;
+} Worker;
+
+struct ThreadPool {
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE wake, done;
+    uintptr_t *threads;
+    Worker *workers;
+    size_t num_workers, running;
+    unsigned long generation;
+    pool_func func;
+    void *arg;
+    bool shutdown;
+    int *cpus;  // The CPUs the workers are pinned to, in turn, NULL if they are not pinned
+    size_t num_cpus;
+};
+
+static void
+pin_worker(ThreadPool *pool, size_t idx) {
+    if (pool->cpus == NULL) return;
+    if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << pool->cpus[idx % pool->num_cpus]) == 0) {
+        fprintf(stderr, "Failed to pin thread to CPU, with error: %lu\n", GetLastError());
+    }
+}
+
+static void
+find_cpus(ThreadPool *pool) {
+    // The CPUs of the processor group of this process, that it may run on, in order
+    DWORD_PTR process_mask, system_mask;
+    int cpu, bits = (int)(8 * sizeof(DWORD_PTR));
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask) || process_mask == 0) return;
+    if ((pool->cpus = (int*)calloc(bits, sizeof(int))) == NULL) return;
+    for (cpu = 0; cpu < bits; cpu++) {
+        if (process_mask & ((DWORD_PTR)1 << cpu)) pool->cpus[pool->num_cpus++] = cpu;
+    }
+}
+
+static unsigned int STDCALL
+worker_main(void *w) {
+    Worker *worker = (Worker*)w;
+    ThreadPool *pool = worker->pool;
+    unsigned long generation = 0;
+    pool_func func;
+    void *arg;
+    pin_worker(pool, worker->idx);
+    EnterCriticalSection(&pool->lock);
+    while (true) {
+        while (!pool->shutdown && pool->generation == generation) SleepConditionVariableCS(&pool->wake, &pool->lock, INFINITE);
+        if (pool->shutdown) break;
+        generation = pool->generation; func = pool->func; arg = pool->arg;
+        LeaveCriticalSection(&pool->lock);
+        func(arg, worker->idx);
+        EnterCriticalSection(&pool->lock);
+        if (--pool->running == 0) WakeConditionVariable(&pool->done);
+    }
+    LeaveCriticalSection(&pool->lock);
+    return 0;
+}
+
 void*
-alloc_threads(size_t num_threads) {
-    return calloc(num_threads, sizeof(uintptr_t));
+alloc_thread_pool(size_t num_workers, bool pin) {
+    ThreadPool *pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+    if (pool == NULL) return NULL;
+    num_workers = MAX(1, num_workers);
+    pool->threads = (uintptr_t*)calloc(num_workers, sizeof(uintptr_t));
+    pool->workers = (Worker*)calloc(num_workers, sizeof(Worker));
+    if (pool->threads == NULL || pool->workers == NULL) { free(pool->threads); free(pool->workers); free(pool); return NULL; }
+    InitializeCriticalSection(&pool->lock);
+    InitializeConditionVariable(&pool->wake);
+    InitializeConditionVariable(&pool->done);
+    if (pin) find_cpus(pool);
+    pool->num_workers = 1;
+    for (size_t i = 1; i < num_workers; i++) {
+        pool->workers[i].pool = pool; pool->workers[i].idx = i;
+        errno = 0;
+        pool->threads[i] = _beginthreadex(NULL, 0, worker_main, pool->workers + i, 0, NULL);
+        if (pool->threads[i] == 0) {
+            perror("Failed to create thread, with error");
+            break;
+        }
+        pool->num_workers++;
+    }
+    return pool;
 }
 
-bool
-start_thread(void* vt, size_t i, unsigned int (STDCALL *start_routine) (void *), void *arg) {
-    uintptr_t *threads = (uintptr_t*)vt;
+size_t
+thread_pool_size(void *pool) {
+    return ((ThreadPool*)pool)->num_workers;
+}
+
+void
+run_in_thread_pool(void *p, pool_func func, void *arg) {
+    ThreadPool *pool = (ThreadPool*)p;
+    if (pool->num_workers > 1) {
+        EnterCriticalSection(&pool->lock);
+        pool->func = func; pool->arg = arg;
+        pool->running = pool->num_workers - 1;
+        pool->generation++;
+        WakeAllConditionVariable(&pool->wake);
+        LeaveCriticalSection(&pool->lock);
+    }
+    func(arg, 0);
+    if (pool->num_workers > 1) {
+        EnterCriticalSection(&pool->lock);
+        while (pool->running) SleepConditionVariableCS(&pool->done, &pool->lock, INFINITE);
+        LeaveCriticalSection(&pool->lock);
+    }
+}
+
+void
+free_thread_pool(void *p) {
+    ThreadPool *pool = (ThreadPool*)p;
+    if (pool == NULL) return;
+    EnterCriticalSection(&pool->lock);
+    pool->shutdown = true;
+    WakeAllConditionVariable(&pool->wake);
+    LeaveCriticalSection(&pool->lock);
+    for (size_t i = 1; i < pool->num_workers; i++) {
+        WaitForSingleObject((HANDLE)pool->threads[i], INFINITE);
+        CloseHandle((HANDLE)pool->threads[i]);
+    }
+    DeleteCriticalSection(&pool->lock);
+    free(pool->threads); free(pool->workers); free(pool->cpus); free(pool);
+}
+
+typedef struct {
+    uintptr_t thread;
+    thread_func func;
+    void *arg;
+} Thread;
+
+static unsigned int STDCALL
+thread_main(void *t) {
+    ((Thread*)t)->func(((Thread*)t)->arg);
+    return 0;
+}
+
+void*
+start_thread(thread_func func, void *arg) {
+    Thread *t = (Thread*)calloc(1, sizeof(Thread));
+    if (t == NULL) return NULL;
+    t->func = func; t->arg = arg;
     errno = 0;
-    threads[i] = _beginthreadex(NULL, 0, start_routine, arg, 0, NULL);
-    if (threads[i] == 0) {
+    if ((t->thread = _beginthreadex(NULL, 0, thread_main, t, 0, NULL)) == 0) {
         perror("Failed to create thread, with error");
-        return false;
+        free(t); return NULL;
     }
-    return true;
+    return t;
 }
 
 void
-wait_for_thread(void *vt, size_t i) {
-    uintptr_t *threads = vt;
-    WaitForSingleObject((HANDLE)threads[i], INFINITE);
-    CloseHandle((HANDLE)threads[i]);
-    threads[i] = 0;
+join_thread(void *t) {
+    WaitForSingleObject((HANDLE)((Thread*)t)->thread, INFINITE);
+    CloseHandle((HANDLE)((Thread*)t)->thread);
+    free(t);
+}
+
+static void (*cancel_callback)(void) = NULL;
+
+static BOOL WINAPI
+on_console_event(DWORD event) {
+    if (event != CTRL_C_EVENT && event != CTRL_BREAK_EVENT && event != CTRL_CLOSE_EVENT) return FALSE;
+    if (cancel_callback) cancel_callback();
+    return TRUE;
+}
+
+bool
+handle_cancel_signals(void (*callback)(void)) {
+    cancel_callback = callback;
+    return SetConsoleCtrlHandler(on_console_event, TRUE) ? true : false;
 }
 
 void
-free_threads(void *threads) {
-    free(threads);
+restore_cancel_signals() {
+    SetConsoleCtrlHandler(on_console_event, FALSE);
+    cancel_callback = NULL;
 }
 
-ssize_t 
-getdelim(char **lineptr, size_t *n, int delim, FILE *stream) {
-    char c, *cur_pos, *new_lineptr;
-    size_t new_lineptr_len;
+void*
+map_file(const char *path, size_t *size) {
+    static char empty[1] = {0};
+    LARGE_INTEGER file_size;
+    HANDLE mapping;
+    void *ans = NULL;
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) { fprintf(stderr, "Failed to open %s with error: %lu\n", path, GetLastError()); return NULL; }
+    if (!GetFileSizeEx(file, &file_size)) { fprintf(stderr, "Failed to get the size of %s with error: %lu\n", path, GetLastError()); CloseHandle(file); return NULL; }
+    *size = (size_t)file_size.QuadPart;
+    if (*size == 0) { CloseHandle(file); return empty; }
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping) { ans = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0); CloseHandle(mapping); }
+    CloseHandle(file);
+    if (ans == NULL) fprintf(stderr, "Failed to map %s with error: %lu\n", path, GetLastError());
+    return ans;
+}
 
-    if (lineptr == NULL || n == NULL || stream == NULL) {
-        errno = EINVAL;
-        return -1;
-    }
+void
+unmap_file(void *addr, size_t size) {
+    if (size > 0) UnmapViewOfFile(addr);
+}
 
-    if (*lineptr == NULL) {
-        *n = 8192; /* init len */
-        if ((*lineptr = (char *)malloc(*n)) == NULL) {
-            errno = ENOMEM;
-            return -1;
-        }
-    }
+bool
+stdin_ready(double timeout) {
+    // There is no portable way to wait for a pipe, so reads simply block
+    (void)timeout;
+    return true;
+}
 
-    cur_pos = *lineptr;
-    for (;;) {
-        c = getc(stream);
+size_t
+stdin_size() {
+    struct _stat64 st;
+    if (_fstat64(_fileno(stdin), &st) != 0 || !(st.st_mode & _S_IFREG) || st.st_size < 0) return 0;
+    return (size_t)st.st_size;
+}
 
-        if (ferror(stream) || (c == EOF && cur_pos == *lineptr))
-            return -1;
+int
+current_cpu() {
+    return (int)GetCurrentProcessorNumber();
+}
 
-        if (c == EOF)
-            break;
+int
+cpu_numa_node(int cpu) {
+    UCHAR node;
+    if (cpu < 0 || cpu > 255 || !GetNumaProcessorNode((UCHAR)cpu, &node) || node == 0xff) return -1;
+    return node;
+}
 
-        if ((*lineptr + *n - cur_pos) < 2) {
-            if (SSIZE_MAX / 2 < *n) {
-#ifdef EOVERFLOW
-                errno = EOVERFLOW;
-#else
-                errno = ERANGE; /* no EOVERFLOW defined */
-#endif
-                return -1;
-            }
-            new_lineptr_len = *n * 2;
-
-            if ((new_lineptr = (char *)realloc(*lineptr, new_lineptr_len)) == NULL) {
-                errno = ENOMEM;
-                return -1;
-            }
-            *lineptr = new_lineptr;
-            *n = new_lineptr_len;
-        }
+typedef struct {
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE cond;
+} Monitor;
 
-        *cur_pos++ = c;
+void*
+alloc_monitor() {
+    Monitor *m = (Monitor*)calloc(1, sizeof(Monitor));
+    if (m == NULL) return NULL;
+    InitializeCriticalSection(&m->lock);
+    InitializeConditionVariable(&m->cond);
+    return m;
+}
 
-        if (c == delim)
-            break;
-    }
+void lock_monitor(void *m) { EnterCriticalSection(&((Monitor*)m)->lock); }
+void unlock_monitor(void *m) { LeaveCriticalSection(&((Monitor*)m)->lock); }
+void wait_on_monitor(void *m) { SleepConditionVariableCS(&((Monitor*)m)->cond, &((Monitor*)m)->lock, INFINITE); }
+void notify_monitor(void *m) { WakeAllConditionVariable(&((Monitor*)m)->cond); }
+
+void
+free_monitor(void *m) {
+    if (m == NULL) return;
+    DeleteCriticalSection(&((Monitor*)m)->lock);
+    free(m);
+}
+
+double
+monotonic_time() {
+    static LARGE_INTEGER frequency = {0};
+    LARGE_INTEGER now;
+    if (!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / frequency.QuadPart;
+}
 
-    *cur_pos = '\0';
-    return (ssize_t)(cur_pos - *lineptr);
+ssize_t
+read_stdin(char *buf, size_t sz) {
+    return _read(_fileno(stdin), buf, (unsigned int)MIN(sz, INT_MAX));
 }